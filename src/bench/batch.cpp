@@ -0,0 +1,62 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+#include <chip8.h>
+#include <batch.h>
+
+// Runs one ROM on LANES separate chip8 objects, then on one chip8_batch of
+// LANES lanes, and reports the aggregate instruction rate of each.
+const unsigned int LANES = 256;
+const uint64_t DEFAULT_CYCLES = 200000;
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2) {
+		std::cerr << "Usage: <ROM> [cycles per lane]" << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+
+	uint64_t cycles = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : DEFAULT_CYCLES;
+
+	std::ifstream file(argv[1], std::ios::binary);
+	if (!file.is_open()) {
+		std::cerr << "Failed to open ROM " << argv[1] << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+	std::vector<uint8_t> rom((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	// Hold a key so ROMs that wait on Fx0A keep executing instead of parking
+	std::vector<std::unique_ptr<chip8>> cpus;
+	for (unsigned int lane = 0; lane < LANES; ++lane) {
+		cpus.push_back(std::make_unique<chip8>());
+		cpus.back()->load_rom(rom.data(), rom.size());
+		cpus.back()->press_key(0);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	uint64_t separate = 0;
+	for (std::unique_ptr<chip8>& cpu : cpus)
+		separate += cpu->run(cycles, chip8::EVENT_NONE);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	std::cout << LANES << " x chip8 (" << CHIP8_DISPATCH_NAME << "): "
+		<< static_cast<uint64_t>(separate / elapsed.count()) << " cycles/sec" << std::endl;
+
+	std::unique_ptr<chip8_batch<LANES>> batch = std::make_unique<chip8_batch<LANES>>();
+	batch->load_rom(rom.data(), rom.size());
+	for (unsigned int lane = 0; lane < LANES; ++lane)
+		batch->press_key(lane, 0);
+
+	start = std::chrono::steady_clock::now();
+	uint64_t batched = batch->run(cycles);
+	elapsed = std::chrono::steady_clock::now() - start;
+
+	std::cout << "chip8_batch<" << LANES << "> (" << CHIP8_BATCH_ISA << "): "
+		<< static_cast<uint64_t>(batched / elapsed.count()) << " cycles/sec, "
+		<< 100.0 * batch->vector_instructions() / batched << "% vector" << std::endl;
+}
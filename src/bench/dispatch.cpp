@@ -0,0 +1,58 @@
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+
+#include <chip8.h>
+#ifdef CHIP8_BENCH_JIT
+#include <jit.h>
+#endif
+
+// Runs a ROM through whichever backend this binary was built with and
+// reports the sustained instruction rate.
+const uint64_t DEFAULT_CYCLES = 20000000;
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2) {
+		std::cerr << "Usage: <ROM> [cycles] [differential|nofusion]" << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+
+	uint64_t cycles = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : DEFAULT_CYCLES;
+
+	std::unique_ptr<chip8> cpu = std::make_unique<chip8>();
+	cpu->load_rom(argv[1]);
+
+	// Hold a key so ROMs that wait on Fx0A keep executing instead of parking
+	cpu->press_key(0);
+
+#ifdef CHIP8_BENCH_JIT
+	std::unique_ptr<chip8_jit> jit = std::make_unique<chip8_jit>(*cpu);
+	jit->set_differential(argc > 3 && std::string(argv[3]) == "differential");
+
+	auto start = std::chrono::steady_clock::now();
+	jit->run(cycles);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	std::cout << "jit (" << CHIP8_DISPATCH_NAME << "): "
+		<< static_cast<uint64_t>(cycles / elapsed.count()) << " cycles/sec, "
+		<< jit->blocks_compiled() << " blocks, " << jit->mismatches() << " mismatches" << std::endl;
+
+	if (jit->mismatches() > 0)
+		std::exit(EXIT_FAILURE);
+#else
+	cpu->set_fusion(cpu->fusion() && !(argc > 3 && std::string(argv[3]) == "nofusion"));
+
+	auto start = std::chrono::steady_clock::now();
+	cpu->run(cycles, chip8::EVENT_NONE);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	std::cout << CHIP8_DISPATCH_NAME << ": "
+		<< static_cast<uint64_t>(cycles / elapsed.count()) << " cycles/sec";
+	if (cpu->fusion())
+		std::cout << ", " << 100.0 * cpu->fused_instructions() / cpu->instructions() << "% fused";
+	std::cout << std::endl;
+#endif
+}
@@ -0,0 +1,59 @@
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+#include <chip8.h>
+
+// Forks a running VM over and over, the way a tree search expands a node,
+// and reports the cost of fork() and restore() and how many pages a child
+// shares with its parent.
+const unsigned int CHILDREN = 100000;
+const uint64_t DEFAULT_STEPS = 100;
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2) {
+		std::cerr << "Usage: <ROM> [cycles per child]" << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+
+	uint64_t steps = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : DEFAULT_STEPS;
+
+	std::ifstream file(argv[1], std::ios::binary);
+	if (!file.is_open()) {
+		std::cerr << "Failed to open ROM " << argv[1] << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+	std::vector<uint8_t> rom((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	std::unique_ptr<chip8> cpu = std::make_unique<chip8>();
+	cpu->load_rom(rom.data(), rom.size());
+	cpu->press_key(0);
+	chip8::State root = cpu->fork();
+
+	// Each child runs a few steps from the root, is forked, then the VM goes back to the root
+	uint64_t shared = 0;
+	double forking = 0.0, restoring = 0.0;
+	for (unsigned int child = 0; child < CHILDREN; ++child) {
+		cpu->set_seed(child);
+		cpu->run(steps, chip8::EVENT_NONE);
+
+		auto start = std::chrono::steady_clock::now();
+		chip8::State state = cpu->fork(root);
+		auto middle = std::chrono::steady_clock::now();
+		cpu->restore(root);
+		auto end = std::chrono::steady_clock::now();
+
+		forking += std::chrono::duration<double>(middle - start).count();
+		restoring += std::chrono::duration<double>(end - middle).count();
+		shared += state.shared_pages(root);
+	}
+
+	std::cout << "fork (" << CHIP8_DISPATCH_NAME << "): " << forking / CHILDREN * 1e9 << " ns, restore "
+		<< restoring / CHILDREN * 1e9 << " ns, " << static_cast<double>(shared) / CHILDREN << " of "
+		<< chip8::State::PAGE_COUNT << " pages shared after " << steps << " cycles" << std::endl;
+}
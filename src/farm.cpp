@@ -0,0 +1,131 @@
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <chip8.h>
+#include <farm.h>
+
+// Runs every ROM `jobs` times, each run with its own seed, across all cores
+// and reports throughput per worker and the spread of job latencies.
+const uint64_t DEFAULT_JOBS = 64;
+const uint64_t DEFAULT_CYCLES = 1000000;
+
+// FNV-1a over the packed display rows, as chestnut_headless prints it
+uint64_t display_hash(const uint64_t* display)
+{
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for (unsigned int y = 0; y < 32; ++y) {
+		for (int shift = 56; shift >= 0; shift -= 8) {
+			hash ^= (display[y] >> shift) & 0xFFu;
+			hash *= 0x100000001B3ull;
+		}
+	}
+	return hash;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2) {
+		std::cerr << "Usage: chestnut_farm <ROM> [rom FILE]... [jobs N] [cycles N] [seed S] [workers N] [slice N]"
+			" [speed N|vip] [key K] [wrap] [list]" << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+
+	std::vector<std::string> paths{ argv[1] };
+	uint64_t jobs_per_rom = DEFAULT_JOBS;
+	uint64_t cycles = DEFAULT_CYCLES;
+	uint32_t seed = 1;
+	unsigned int workers = 0;
+	uint64_t slice = Farm::DEFAULT_SLICE;
+	bool list = false;
+
+	// Every job's VM starts as a copy of this one
+	std::unique_ptr<chip8> prototype = std::make_unique<chip8>();
+
+	for (int i = 2; i < argc; ++i) {
+		std::string option = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+		if (option == "list") {
+			list = true;
+		}
+		else if (option == "vip") {
+			prototype->set_vip_timing();
+		}
+		else if (option == "wrap") {
+			prototype->set_sprite_wrap(true);
+		}
+		else if (value && option == "rom") {
+			paths.push_back(value);
+			++i;
+		}
+		else if (value && option == "jobs") {
+			jobs_per_rom = std::strtoull(value, nullptr, 10);
+			++i;
+		}
+		else if (value && option == "cycles") {
+			cycles = std::strtoull(value, nullptr, 10);
+			++i;
+		}
+		else if (value && option == "seed") {
+			// Job n of a ROM runs with seed S + n
+			seed = static_cast<uint32_t>(std::strtoul(value, nullptr, 10));
+			++i;
+		}
+		else if (value && option == "workers") {
+			workers = static_cast<unsigned int>(std::strtoul(value, nullptr, 10));
+			++i;
+		}
+		else if (value && option == "slice") {
+			slice = std::strtoull(value, nullptr, 10);
+			++i;
+		}
+		else if (value && option == "speed") {
+			prototype->set_speed(static_cast<uint32_t>(std::strtoul(value, nullptr, 10)));
+			++i;
+		}
+		else if (value && option == "key") {
+			// Held for the whole run, for ROMs that wait on Fx0A
+			prototype->press_key(static_cast<uint8_t>(std::strtoul(value, nullptr, 16)));
+			++i;
+		}
+		else {
+			std::cerr << "Unknown option " << option << std::endl;
+			std::exit(EXIT_FAILURE);
+		}
+	}
+
+	std::vector<std::vector<uint8_t>> roms;
+	for (const std::string& path : paths) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file.is_open()) {
+			std::cerr << "Failed to open ROM " << path << std::endl;
+			std::exit(EXIT_FAILURE);
+		}
+		roms.emplace_back((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	}
+
+	std::vector<Farm::Job> jobs;
+	for (const std::vector<uint8_t>& rom : roms) {
+		for (uint64_t n = 0; n < jobs_per_rom; ++n)
+			jobs.push_back(Farm::Job{ &rom, static_cast<uint32_t>(seed + n), cycles });
+	}
+
+	Farm farm(workers);
+	farm.set_slice(slice);
+	farm.run(jobs, *prototype);
+
+	if (list) {
+		for (const Farm::Job& job : jobs) {
+			std::cout << paths[job.rom - roms.data()] << " seed " << job.seed << ": " << job.executed << " cycles, display "
+				<< std::hex << std::setw(16) << std::setfill('0') << display_hash(job.display) << std::dec << std::setfill(' ')
+				<< ", done at " << job.finished * 1e3 << " ms on worker " << job.worker << std::endl;
+		}
+	}
+	farm.report(std::cout, jobs);
+}
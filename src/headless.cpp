@@ -0,0 +1,206 @@
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <chip8.h>
+#include <recorder.h>
+#include <scaler.h>
+
+// Runs a ROM without a window or GL context, as fast as the host allows.
+// Emulated time still follows the configured speed, so frame N is the same
+// frame the windowed build would show N/60 seconds in.
+const uint64_t DEFAULT_FRAMES = 600;
+
+// FNV-1a over the packed display rows
+uint64_t display_hash(const chip8& cpu)
+{
+	uint64_t hash = 0xCBF29CE484222325ull;
+	for (unsigned int y = 0; y < 32; ++y) {
+		for (int shift = 56; shift >= 0; shift -= 8) {
+			hash ^= (cpu.display()[y] >> shift) & 0xFFu;
+			hash *= 0x100000001B3ull;
+		}
+	}
+	return hash;
+}
+
+// Binary PBM, whose rows are packed most significant bit first like the display
+bool write_pbm(const std::string& path, const chip8& cpu)
+{
+	std::ofstream out(path, std::ios::binary);
+	if (!out.is_open())
+		return false;
+
+	out << "P4\n64 32\n";
+	for (unsigned int y = 0; y < 32; ++y) {
+		for (int shift = 56; shift >= 0; shift -= 8)
+			out.put(static_cast<char>((cpu.display()[y] >> shift) & 0xFFu));
+	}
+	return out.good();
+}
+
+// Upscaled RGBA as a PAM image, white on black like the window
+bool write_pam(const std::string& path, const chip8& cpu, const Scaler& scaler, unsigned int scale, Scaler::Filter filter)
+{
+	static const uint32_t palette[2] = { 0xFF000000, 0xFFFFFFFF };
+	unsigned int width = 64 * scale, height = 32 * scale;
+	std::vector<uint32_t> pixels(static_cast<size_t>(width) * height);
+
+	if (filter == Scaler::FILTER_NEAREST) {
+		scaler.render(cpu.display(), 64, 32, scale, palette, pixels.data());
+	}
+	else {
+		std::vector<uint8_t> indices(64 * 32), scaled(pixels.size());
+		scaler.unpack(cpu.display(), 64, 32, indices.data());
+		scaler.upscale(indices.data(), 64, 32, filter, scale, scaled.data());
+		scaler.map(scaled.data(), scaled.size(), palette, 2, pixels.data());
+	}
+
+	std::ofstream out(path, std::ios::binary);
+	if (!out.is_open())
+		return false;
+
+	// Words are 0xAABBGGRR, so little-endian memory order is already R G B A
+	out << "P7\nWIDTH " << width << "\nHEIGHT " << height << "\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+	out.write(reinterpret_cast<const char*>(pixels.data()), pixels.size() * sizeof(uint32_t));
+	return out.good();
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 2) {
+		std::cerr << "Usage: chestnut_headless <ROM> [frames N|cycles N] [speed N|vip] [key K] [dump DIR] [record FILE]"
+			" [scale N] [scale2x|scale3x] [hash]" << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+
+	std::ifstream file(argv[1], std::ios::binary);
+	if (!file.is_open()) {
+		std::cerr << "Failed to open ROM " << argv[1] << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+	std::vector<uint8_t> rom((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	std::unique_ptr<chip8> cpu = std::make_unique<chip8>();
+	cpu->load_rom(rom.data(), rom.size());
+
+	uint64_t frames = DEFAULT_FRAMES;
+	uint64_t cycles = UINT64_MAX;
+	const char* dump_dir = nullptr;
+	const char* record_path = nullptr;
+	unsigned int scale = 1;
+	Scaler::Filter filter = Scaler::FILTER_NEAREST;
+	Recorder recorder;
+	bool hash = false;
+
+	for (int i = 2; i < argc; ++i) {
+		std::string option = argv[i];
+		const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+		if (option == "hash") {
+			hash = true;
+		}
+		else if (option == "vip") {
+			cpu->set_vip_timing();
+		}
+		else if (option == "scale2x") {
+			filter = Scaler::FILTER_SCALE2X;
+		}
+		else if (option == "scale3x") {
+			filter = Scaler::FILTER_SCALE3X;
+		}
+		else if (value && option == "frames") {
+			frames = std::strtoull(value, nullptr, 10);
+			cycles = UINT64_MAX;
+			++i;
+		}
+		else if (value && option == "cycles") {
+			cycles = std::strtoull(value, nullptr, 10);
+			frames = UINT64_MAX;
+			++i;
+		}
+		else if (value && option == "speed") {
+			cpu->set_speed(static_cast<uint32_t>(std::strtoul(value, nullptr, 10)));
+			++i;
+		}
+		else if (value && option == "key") {
+			// Held for the whole run, for ROMs that wait on Fx0A
+			cpu->press_key(static_cast<uint8_t>(std::strtoul(value, nullptr, 16)));
+			++i;
+		}
+		else if (value && option == "dump") {
+			dump_dir = value;
+			++i;
+		}
+		else if (value && option == "record") {
+			// .gif, .y4m or raw 1bpp
+			record_path = value;
+			++i;
+		}
+		else if (value && option == "scale") {
+			scale = static_cast<unsigned int>(std::strtoul(value, nullptr, 10));
+			++i;
+		}
+		else {
+			std::cerr << "Unknown option " << option << std::endl;
+			std::exit(EXIT_FAILURE);
+		}
+	}
+
+	// EPX filters scale by their own factor at least, the rest is nearest neighbour
+	unsigned int step = filter == Scaler::FILTER_SCALE2X ? 2 : filter == Scaler::FILTER_SCALE3X ? 3 : 1;
+	if (scale == 1)
+		scale = step;
+	if (scale == 0 || scale % step != 0) {
+		std::cerr << "scale must be a multiple of " << step << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+
+	if (record_path) {
+		recorder.set_scale(scale, filter);
+		if (!recorder.open(record_path)) {
+			std::cerr << "Failed to write " << record_path << std::endl;
+			std::exit(EXIT_FAILURE);
+		}
+	}
+
+	Scaler scaler;
+	auto start = std::chrono::steady_clock::now();
+
+	// One timer frame per run(), stopping early once the cycle budget is spent
+	uint64_t frame = 0, executed = 0;
+	while (frame < frames && executed < cycles) {
+		executed += cpu->run(cycles - executed, chip8::EVENT_TIMER);
+		if (cpu->events() & chip8::EVENT_TIMER) {
+			++frame;
+			recorder.record(cpu->display());
+		}
+
+		if (dump_dir && cpu->take_dirty_rows()) {
+			std::ostringstream path;
+			path << dump_dir << "/frame_" << std::setw(6) << std::setfill('0') << frame << (scale > 1 ? ".pam" : ".pbm");
+			if (!(scale > 1 ? write_pam(path.str(), *cpu, scaler, scale, filter) : write_pbm(path.str(), *cpu))) {
+				std::cerr << "Failed to write " << path.str() << std::endl;
+				std::exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	if (recorder.is_open()) {
+		recorder.close();
+		recorder.report(std::cout);
+	}
+	std::cout << frame << " frames, " << executed << " cycles in " << elapsed.count() << " s" << std::endl;
+	if (hash)
+		std::cout << "display " << std::hex << std::setw(16) << std::setfill('0') << display_hash(*cpu) << std::endl;
+}
@@ -0,0 +1,120 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <chip8.h>
+
+// Runtime support for translation units generated by chestnut_aot.
+//
+// A generated unit embeds the ROM, the address range of every basic block it
+// translated, and a run function that dispatches on the PC. A block only runs
+// natively while the memory it was translated from still matches the ROM;
+// writes reported through chip8::set_write_hook re-check the blocks they
+// touch. Anything without a valid translation, including every target of an
+// indirect Bnnn jump the walker could not see, is interpreted.
+class chip8_aot {
+public:
+	struct Block {
+		uint16_t start;
+		uint16_t end;
+	};
+
+	typedef void (*RunFunc)(chip8_aot&, uint64_t);
+
+	inline chip8_aot(chip8& cpu, const uint8_t* rom, size_t rom_size, const Block* blocks, size_t block_count);
+	inline ~chip8_aot();
+
+	chip8_aot(const chip8_aot&) = delete;
+	chip8_aot& operator=(const chip8_aot&) = delete;
+
+	chip8& cpu() { return _cpu; }
+	bool valid(size_t block) const { return _valid[block]; }
+
+	// Interpret one instruction, for addresses without a usable translation
+	void fallback() { ++_fallbacks; _cpu.cycle(); }
+	uint64_t fallbacks() const { return _fallbacks; }
+
+	// State accessors used by generated code
+	static uint8_t*  registers(chip8& c) { return c._register; }
+	static uint16_t* stack(chip8& c) { return c._stack; }
+	static uint16_t& pc(chip8& c) { return c._pc; }
+	static uint8_t&  sp(chip8& c) { return c._sp; }
+	static uint16_t& index(chip8& c) { return c._index; }
+	static uint8_t&  delay_timer(chip8& c) { return c._delay_timer; }
+	static uint8_t&  sound_timer(chip8& c) { return c._sound_timer; }
+	static void tick(chip8& c, uint8_t id) { c.retire(id); }
+	static void call(chip8& c, uint16_t opcode) { c.execute_opcode(opcode); }
+	static bool halted(chip8& c) { return c._halted; }
+	static uint64_t wait_for_key(chip8& c, uint64_t cycles) { return c.wait_for_key(cycles, chip8::EVENT_NONE); }
+
+	// Entry point for the executable built by chestnut_add_aot_executable
+	static inline int main(int argc, char* argv[], const uint8_t* rom, size_t rom_size,
+		const Block* blocks, size_t block_count, RunFunc run);
+
+private:
+	chip8&            _cpu;
+	const uint8_t*    _rom;
+	size_t            _rom_size;
+	const Block*      _blocks;
+	size_t            _block_count;
+	std::vector<bool> _valid;
+	uint64_t          _fallbacks{ 0 };
+
+	static inline void on_write(void* user, uint16_t address, size_t length);
+};
+
+chip8_aot::chip8_aot(chip8& cpu, const uint8_t* rom, size_t rom_size, const Block* blocks, size_t block_count)
+	: _cpu(cpu), _rom(rom), _rom_size(rom_size), _blocks(blocks), _block_count(block_count), _valid(block_count, true)
+{
+	_cpu.load_rom(rom, rom_size);
+	_cpu.set_write_hook(&chip8_aot::on_write, this);
+}
+
+chip8_aot::~chip8_aot()
+{
+	_cpu.set_write_hook(nullptr, nullptr);
+}
+
+void chip8_aot::on_write(void* user, uint16_t address, size_t length)
+{
+	chip8_aot& aot = *static_cast<chip8_aot*>(user);
+	size_t last = address + length;
+
+	for (size_t i = 0; i < aot._block_count; ++i) {
+		const Block& block = aot._blocks[i];
+		if (block.start < last && address < block.end) {
+			// Writing back the original bytes makes the translation usable again
+			aot._valid[i] = memcmp(&aot._cpu._memory[block.start], &aot._rom[block.start - START_ADDRESS],
+				block.end - block.start) == 0;
+		}
+	}
+}
+
+int chip8_aot::main(int argc, char* argv[], const uint8_t* rom, size_t rom_size,
+	const Block* blocks, size_t block_count, RunFunc run)
+{
+	uint64_t cycles = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 20000000;
+
+	std::unique_ptr<chip8> cpu = std::make_unique<chip8>();
+	chip8_aot aot(*cpu, rom, rom_size, blocks, block_count);
+
+	// Same as the dispatch bench, a held key keeps Fx0A from parking the CPU
+	cpu->press_key(0);
+
+	auto start = std::chrono::steady_clock::now();
+	run(aot, cycles);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	std::cout << "aot: " << static_cast<uint64_t>(cycles / elapsed.count()) << " cycles/sec, "
+		<< block_count << " blocks, " << aot.fallbacks() << " interpreted" << std::endl;
+	return EXIT_SUCCESS;
+}
+
+#endif // !AOT_H
@@ -0,0 +1,989 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <chip8.h>
+
+// Group kernels use the widest vectors the build targets: AVX2 with -mavx2
+// or /arch:AVX2, SSE2 on any other x86-64 build, none elsewhere.
+#if defined(__AVX2__)
+#define CHIP8_BATCH_AVX2 1
+#define CHIP8_BATCH_ISA "avx2"
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#define CHIP8_BATCH_SSE2 1
+#define CHIP8_BATCH_ISA "sse2"
+#include <emmintrin.h>
+#else
+#define CHIP8_BATCH_ISA "scalar"
+#endif
+
+const unsigned int BATCH_MAX_GROUPS = 4;		// opcode groups tried per step before the rest go one lane at a time
+const unsigned int BATCH_MIN_GROUP_LANES = 8;	// smaller groups aren't worth a pass over every lane
+
+// Set lanes in a movemask
+inline unsigned int batch_popcount(uint32_t bits)
+{
+	bits = bits - ((bits >> 1) & 0x55555555u);
+	bits = (bits & 0x33333333u) + ((bits >> 2) & 0x33333333u);
+	bits = (bits + (bits >> 4)) & 0x0F0F0F0Fu;
+	return (bits * 0x01010101u) >> 24;
+}
+
+#if defined(CHIP8_BATCH_AVX2)
+// Lane operations over 32 lanes of bytes, 16 of words or 8 of dwords
+struct batch_avx2 {
+	typedef __m256i V;
+	static const unsigned int LANES = 32;
+
+	static V load(const void* p) { return _mm256_loadu_si256(static_cast<const V*>(p)); }
+	static void store(void* p, V v) { _mm256_storeu_si256(static_cast<V*>(p), v); }
+	static V zero() { return _mm256_setzero_si256(); }
+	static V set8(uint8_t value) { return _mm256_set1_epi8(static_cast<char>(value)); }
+	static V set16(uint16_t value) { return _mm256_set1_epi16(static_cast<short>(value)); }
+	static V set32(int32_t value) { return _mm256_set1_epi32(value); }
+
+	static V and_(V a, V b) { return _mm256_and_si256(a, b); }
+	static V or_(V a, V b) { return _mm256_or_si256(a, b); }
+	static V xor_(V a, V b) { return _mm256_xor_si256(a, b); }
+	static V not_(V a) { return _mm256_xor_si256(a, _mm256_set1_epi8(-1)); }
+	static V blend(V mask, V a, V b) { return _mm256_blendv_epi8(b, a, mask); }
+	static bool any(V mask) { return !_mm256_testz_si256(mask, mask); }
+	static bool all(V mask) { return _mm256_movemask_epi8(mask) == -1; }
+	static unsigned int count(V mask) { return batch_popcount(static_cast<uint32_t>(_mm256_movemask_epi8(mask))); }
+
+	static V eq8(V a, V b) { return _mm256_cmpeq_epi8(a, b); }
+	static V add8(V a, V b) { return _mm256_add_epi8(a, b); }
+	static V sub8(V a, V b) { return _mm256_sub_epi8(a, b); }
+	static V adds8(V a, V b) { return _mm256_adds_epu8(a, b); }
+	static V subs8(V a, V b) { return _mm256_subs_epu8(a, b); }
+	static V shr8(V a, int bits) { return _mm256_and_si256(_mm256_srli_epi16(a, bits), set8(static_cast<uint8_t>(0xFF >> bits))); }
+
+	static V eq16(V a, V b) { return _mm256_cmpeq_epi16(a, b); }
+	static V add16(V a, V b) { return _mm256_add_epi16(a, b); }
+	static V mul16(V a, V b) { return _mm256_mullo_epi16(a, b); }
+	static V shl16(V a, int bits) { return _mm256_slli_epi16(a, bits); }
+	static V sub32(V a, V b) { return _mm256_sub_epi32(a, b); }
+	static V gt32(V a, V b) { return _mm256_cmpgt_epi32(a, b); }
+
+	// Byte lanes [16 * half, 16 * half + 16) as words, zero or sign extended
+	static __m128i half(V a, unsigned int h) { return h ? _mm256_extracti128_si256(a, 1) : _mm256_castsi256_si128(a); }
+	static V widen16(V a, unsigned int h) { return _mm256_cvtepu8_epi16(half(a, h)); }
+	static V mask16(V mask, unsigned int h) { return _mm256_cvtepi8_epi16(half(mask, h)); }
+	// Two word masks back to one byte mask, packs works within each 128-bit half
+	static V narrow16(V a, V b) { return _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8); }
+	// Byte lanes [8 * quarter, 8 * quarter + 8) as dwords
+	static V mask32(V mask, unsigned int q)
+	{
+		__m128i bytes = half(mask, q / 2);
+		return _mm256_cvtepi8_epi32(q % 2 ? _mm_srli_si128(bytes, 8) : bytes);
+	}
+};
+#endif
+
+#if defined(CHIP8_BATCH_SSE2)
+// Lane operations over 16 lanes of bytes, 8 of words or 4 of dwords
+struct batch_sse2 {
+	typedef __m128i V;
+	static const unsigned int LANES = 16;
+
+	static V load(const void* p) { return _mm_loadu_si128(static_cast<const V*>(p)); }
+	static void store(void* p, V v) { _mm_storeu_si128(static_cast<V*>(p), v); }
+	static V zero() { return _mm_setzero_si128(); }
+	static V set8(uint8_t value) { return _mm_set1_epi8(static_cast<char>(value)); }
+	static V set16(uint16_t value) { return _mm_set1_epi16(static_cast<short>(value)); }
+	static V set32(int32_t value) { return _mm_set1_epi32(value); }
+
+	static V and_(V a, V b) { return _mm_and_si128(a, b); }
+	static V or_(V a, V b) { return _mm_or_si128(a, b); }
+	static V xor_(V a, V b) { return _mm_xor_si128(a, b); }
+	static V not_(V a) { return _mm_xor_si128(a, _mm_set1_epi8(-1)); }
+	static V blend(V mask, V a, V b) { return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b)); }
+	static bool any(V mask) { return _mm_movemask_epi8(mask) != 0; }
+	static bool all(V mask) { return _mm_movemask_epi8(mask) == 0xFFFF; }
+	static unsigned int count(V mask) { return batch_popcount(static_cast<uint32_t>(_mm_movemask_epi8(mask))); }
+
+	static V eq8(V a, V b) { return _mm_cmpeq_epi8(a, b); }
+	static V add8(V a, V b) { return _mm_add_epi8(a, b); }
+	static V sub8(V a, V b) { return _mm_sub_epi8(a, b); }
+	static V adds8(V a, V b) { return _mm_adds_epu8(a, b); }
+	static V subs8(V a, V b) { return _mm_subs_epu8(a, b); }
+	static V shr8(V a, int bits) { return _mm_and_si128(_mm_srli_epi16(a, bits), set8(static_cast<uint8_t>(0xFF >> bits))); }
+
+	static V eq16(V a, V b) { return _mm_cmpeq_epi16(a, b); }
+	static V add16(V a, V b) { return _mm_add_epi16(a, b); }
+	static V mul16(V a, V b) { return _mm_mullo_epi16(a, b); }
+	static V shl16(V a, int bits) { return _mm_slli_epi16(a, bits); }
+	static V sub32(V a, V b) { return _mm_sub_epi32(a, b); }
+	static V gt32(V a, V b) { return _mm_cmpgt_epi32(a, b); }
+
+	static V widen16(V a, unsigned int h) { return h ? _mm_unpackhi_epi8(a, zero()) : _mm_unpacklo_epi8(a, zero()); }
+	static V mask16(V mask, unsigned int h) { return h ? _mm_unpackhi_epi8(mask, mask) : _mm_unpacklo_epi8(mask, mask); }
+	static V narrow16(V a, V b) { return _mm_packs_epi16(a, b); }
+	static V mask32(V mask, unsigned int q)
+	{
+		V words = mask16(mask, q / 2);
+		return q % 2 ? _mm_unpackhi_epi16(words, words) : _mm_unpacklo_epi16(words, words);
+	}
+};
+#endif
+
+// N copies of the chip8 VM stepped in lockstep, for running one ROM many
+// times over (fuzzing, search, training).
+//
+// State is stored structure-of-arrays: register V3 of every lane is one
+// contiguous run of N bytes, and so are the program counters, timers and
+// each display row. Memory is address-major for the same reason, the byte
+// at one address for all lanes sits together.
+//
+// Each step fetches one opcode per lane, then groups lanes holding the same
+// opcode. A group of register, flow or timer instructions runs as one pass
+// of vector code over all lanes with a lane mask, and so do calls and
+// returns while the lanes share a stack depth, and with AVX2 sprites while
+// they share Vy and I. Lanes that have drifted apart, and the remaining
+// memory and display instructions, run one lane at a time. Lanes of the
+// same ROM mostly stay together, so most instructions take the vector path.
+//
+// Every lane behaves exactly like a chip8 with the same clock settings,
+// except that spin loops are stepped through instead of skipped.
+//
+// The object holds 4 KB of memory per lane, allocate it on the heap.
+template <unsigned int N>
+class chip8_batch {
+	static_assert(N > 0 && N % 32 == 0, "lanes come in whole AVX2 vectors");
+
+public:
+	static const unsigned int LANES = N;
+
+	chip8_batch();
+
+	chip8_batch(const chip8_batch&) = delete;
+	chip8_batch& operator=(const chip8_batch&) = delete;
+
+	// Loads the ROM into every lane
+	void load_rom(const uint8_t* data, size_t size);
+
+	// Clock and quirk settings shared by all lanes, see chip8
+	void set_speed(uint32_t instructions_per_second);
+	void set_vip_timing();
+	void set_sprite_wrap(bool enabled) { _sprite_wrap = enabled; }
+
+	// Runs up to `cycles` instructions on every lane. A lane stops early after
+	// an instruction raising one of the events in `stop_on`. Returns the number
+	// of instructions executed across all lanes.
+	uint64_t run(uint64_t cycles, uint8_t stop_on = chip8::EVENT_NONE);
+
+	// Events raised on a lane by the last run()
+	uint8_t events(unsigned int lane) const { return _events[lane]; }
+
+	void press_key(unsigned int lane, uint8_t key);
+	void release_key(unsigned int lane, uint8_t key) { _keypad[key & 0xFu][lane] = 0; }
+	void set_seed(unsigned int lane, uint32_t seed) { _random[lane] = seed; }
+
+	bool     halted(unsigned int lane) const { return _halted[lane] != 0; }
+	uint16_t pc(unsigned int lane) const { return _pc[lane]; }
+	uint8_t  reg(unsigned int lane, uint8_t r) const { return _register[r & 0xFu][lane]; }
+	uint64_t row(unsigned int lane, unsigned int y) const { return _display[y % 32][lane]; }
+	bool     pixel(unsigned int lane, unsigned int x, unsigned int y) const { return (row(lane, y) >> (63 - x % 64)) & 1u; }
+
+	// Moves complete VM state between a lane and an ordinary chip8. The
+	// clock settings stay the batch's, copy_to() gives them to the chip8.
+	void copy_from(unsigned int lane, const chip8& cpu);
+	void copy_to(unsigned int lane, chip8& cpu) const;
+
+	// Instructions that ran inside a group kernel, and one lane at a time
+	uint64_t vector_instructions() const { return _vector_instructions; }
+	uint64_t scalar_instructions() const { return _scalar_instructions; }
+
+private:
+	alignas(32) uint8_t  _register[16][N];
+	alignas(32) uint16_t _pc[N];
+	alignas(32) uint16_t _index[N];
+	alignas(32) uint8_t  _delay_timer[N];
+	alignas(32) uint8_t  _sound_timer[N];
+	alignas(32) int32_t  _countdown[N];	// clock units until the next 60 Hz tick, chip8's _next_tick - _time
+	alignas(32) uint64_t _display[32][N];
+	alignas(32) uint8_t  _memory[4096 * N];
+	alignas(32) uint16_t _stack[16][N];
+	alignas(32) uint8_t  _sp[N];
+	alignas(32) uint8_t  _keypad[16][N];
+	alignas(32) uint8_t  _halted[N];
+	uint8_t  _halt_register[N];
+	uint32_t _dirty_rows[N];
+	uint32_t _random[N];
+	uint8_t  _events[N];
+
+	// Per run() and per step
+	alignas(32) uint8_t  _active[N];	// 0xFF until the lane stops
+	alignas(32) uint16_t _opcode[N];
+	alignas(32) uint8_t  _ready[N];	// 0xFF while the lane's fetched instruction hasn't run
+	alignas(32) uint8_t  _group[N];	// 0xFF for the lanes of the group being executed
+	uint8_t  _stop_on{ chip8::EVENT_NONE };
+
+	uint32_t _costs[chip8::ID_COUNT]{ 0 };
+	int32_t  _tick_period{ 0 };
+	bool     _sprite_wrap{ false };
+
+	uint64_t _vector_instructions{ 0 };
+	uint64_t _scalar_instructions{ 0 };
+
+	uint8_t& memory(unsigned int lane, uint16_t address) { return _memory[(address & 0xFFFu) * N + lane]; }
+	uint8_t  memory(unsigned int lane, uint16_t address) const { return _memory[(address & 0xFFFu) * N + lane]; }
+
+	unsigned int step();
+	void fetch_lanes(unsigned int begin, unsigned int end, unsigned int& executed, unsigned int& pending);
+	template <typename S> void fetch(unsigned int& executed, unsigned int& pending);
+	template <typename S> unsigned int select(uint16_t opcode, unsigned int first);
+	bool resume(unsigned int lane);
+	void retire(unsigned int lane, uint8_t id);
+	void tick_timers(unsigned int lane);
+	void execute_lane(unsigned int lane, uint16_t opcode, uint8_t id);
+
+	static constexpr bool vectorised(uint8_t id);
+	template <typename S> void execute_group(uint16_t opcode, uint8_t id);
+	void execute_lanes(unsigned int begin, unsigned int count, uint16_t opcode, uint8_t id);
+#if defined(CHIP8_BATCH_AVX2)
+	bool draw_avx2(unsigned int c, uint16_t opcode);
+#endif
+};
+
+template <unsigned int N>
+chip8_batch<N>::chip8_batch()
+{
+	memset(_register, 0, sizeof(_register));
+	memset(_index, 0, sizeof(_index));
+	memset(_delay_timer, 0, sizeof(_delay_timer));
+	memset(_sound_timer, 0, sizeof(_sound_timer));
+	memset(_display, 0, sizeof(_display));
+	memset(_memory, 0, sizeof(_memory));
+	memset(_stack, 0, sizeof(_stack));
+	memset(_sp, 0, sizeof(_sp));
+	memset(_keypad, 0, sizeof(_keypad));
+	memset(_halted, 0, sizeof(_halted));
+	memset(_halt_register, 0, sizeof(_halt_register));
+	memset(_events, 0, sizeof(_events));
+	memset(_active, 0, sizeof(_active));
+	memset(_ready, 0, sizeof(_ready));
+	memset(_group, 0, sizeof(_group));
+
+	for (unsigned int lane = 0; lane < N; ++lane) {
+		_pc[lane] = START_ADDRESS;
+		_dirty_rows[lane] = 0xFFFFFFFF;
+		_random[lane] = 1;
+	}
+	for (unsigned int i = 0; i < FONTSET_SIZE; ++i)
+		memset(&_memory[(FONTSET_START_ADDRESS + i) * N], fontset[i], N);
+
+	set_speed(DEFAULT_INSTRUCTIONS_PER_SECOND);
+}
+
+template <unsigned int N>
+void chip8_batch<N>::load_rom(const uint8_t* data, size_t size)
+{
+	if (size > 4096 - START_ADDRESS)
+		size = 4096 - START_ADDRESS;
+
+	for (size_t i = 0; i < size; ++i)
+		memset(&_memory[(START_ADDRESS + i) * N], data[i], N);
+}
+
+template <unsigned int N>
+void chip8_batch<N>::set_speed(uint32_t instructions_per_second)
+{
+	std::fill(std::begin(_costs), std::end(_costs), TIMER_FREQUENCY);
+	_tick_period = static_cast<int32_t>(std::max<uint32_t>(std::min<uint32_t>(instructions_per_second, INT32_MAX / 2), 1));
+	std::fill(std::begin(_countdown), std::end(_countdown), _tick_period);
+}
+
+template <unsigned int N>
+void chip8_batch<N>::set_vip_timing()
+{
+	for (uint8_t id = 0; id < chip8::ID_COUNT; ++id)
+		_costs[id] = chip8::vip_microseconds(id) * TIMER_FREQUENCY;
+	_tick_period = 1000000;
+	std::fill(std::begin(_countdown), std::end(_countdown), _tick_period);
+}
+
+template <unsigned int N>
+void chip8_batch<N>::press_key(unsigned int lane, uint8_t key)
+{
+	key &= 0xFu;
+	_keypad[key][lane] = 1;
+
+	if (_halted[lane]) {
+		_register[_halt_register[lane]][lane] = key;
+		_halted[lane] = 0;
+	}
+}
+
+template <unsigned int N>
+void chip8_batch<N>::copy_from(unsigned int lane, const chip8& cpu)
+{
+	for (unsigned int r = 0; r < 16; ++r) {
+		_register[r][lane] = cpu._register[r];
+		_stack[r][lane] = cpu._stack[r];
+		_keypad[r][lane] = cpu._keypad[r];
+	}
+	for (unsigned int y = 0; y < 32; ++y)
+		_display[y][lane] = cpu._display[y];
+	for (unsigned int address = 0; address < 4096; ++address)
+		memory(lane, static_cast<uint16_t>(address)) = cpu._memory[address];
+
+	_pc[lane] = cpu._pc;
+	_index[lane] = cpu._index;
+	_sp[lane] = cpu._sp;
+	_delay_timer[lane] = cpu._delay_timer;
+	_sound_timer[lane] = cpu._sound_timer;
+	_halted[lane] = cpu._halted;
+	_halt_register[lane] = cpu._halt_register;
+	_dirty_rows[lane] = cpu._dirty_rows;
+	_random[lane] = cpu._random;
+	_countdown[lane] = static_cast<int32_t>(std::min<uint64_t>(cpu._next_tick - cpu._time, static_cast<uint64_t>(_tick_period)));
+}
+
+template <unsigned int N>
+void chip8_batch<N>::copy_to(unsigned int lane, chip8& cpu) const
+{
+	for (unsigned int r = 0; r < 16; ++r) {
+		cpu._register[r] = _register[r][lane];
+		cpu._stack[r] = _stack[r][lane];
+		cpu._keypad[r] = _keypad[r][lane];
+	}
+	for (unsigned int y = 0; y < 32; ++y)
+		cpu._display[y] = _display[y][lane];
+	for (unsigned int address = 0; address < 4096; ++address)
+		cpu._memory[address] = memory(lane, static_cast<uint16_t>(address));
+
+	cpu._pc = _pc[lane];
+	cpu._index = _index[lane];
+	cpu._sp = _sp[lane];
+	cpu._delay_timer = _delay_timer[lane];
+	cpu._sound_timer = _sound_timer[lane];
+	cpu._halted = _halted[lane] != 0;
+	cpu._halt_register = _halt_register[lane];
+	cpu._dirty_rows = _dirty_rows[lane];
+	cpu._random = _random[lane];
+
+	std::copy(std::begin(_costs), std::end(_costs), cpu._costs);
+	cpu._tick_period = static_cast<uint64_t>(_tick_period);
+	cpu._time = 0;
+	cpu._next_tick = static_cast<uint64_t>(_countdown[lane]);
+	cpu.memory_written(0, 4096);
+}
+
+template <unsigned int N>
+uint64_t chip8_batch<N>::run(uint64_t cycles, uint8_t stop_on)
+{
+	_stop_on = stop_on;
+	memset(_events, 0, sizeof(_events));
+	memset(_active, 0xFF, sizeof(_active));
+
+	// Every running lane executes one instruction per step, so they share the budget
+	uint64_t executed = 0;
+	for (uint64_t i = 0; i < cycles; ++i) {
+		unsigned int lanes = step();
+		if (lanes == 0)
+			break;
+		executed += lanes;
+	}
+	return executed;
+}
+
+// Runs one instruction on every active lane, returning how many that was
+template <unsigned int N>
+unsigned int chip8_batch<N>::step()
+{
+	static constexpr std::array<uint8_t, 0x10000> ids = chip8::make_id_table();
+
+	unsigned int executed = 0, pending = 0;
+#if defined(CHIP8_BATCH_AVX2)
+	fetch<batch_avx2>(executed, pending);
+#elif defined(CHIP8_BATCH_SSE2)
+	fetch<batch_sse2>(executed, pending);
+#else
+	fetch_lanes(0, N, executed, pending);
+#endif
+
+	// Execute, one opcode group at a time
+	unsigned int first = 0, groups = 0;
+	while (pending > 0) {
+		while (!_ready[first])
+			++first;
+
+		uint16_t opcode = _opcode[first];
+		uint8_t id = ids[opcode];
+
+#if defined(CHIP8_BATCH_AVX2) || defined(CHIP8_BATCH_SSE2)
+		if (groups < BATCH_MAX_GROUPS && vectorised(id)) {
+			++groups;
+#if defined(CHIP8_BATCH_AVX2)
+			unsigned int count = select<batch_avx2>(opcode, first);
+#else
+			unsigned int count = select<batch_sse2>(opcode, first);
+#endif
+			pending -= count;
+
+			if (count >= BATCH_MIN_GROUP_LANES) {
+				_vector_instructions += count;
+#if defined(CHIP8_BATCH_AVX2)
+				execute_group<batch_avx2>(opcode, id);
+#else
+				execute_group<batch_sse2>(opcode, id);
+#endif
+				continue;
+			}
+
+			for (unsigned int lane = first; lane < N; ++lane) {
+				if (_group[lane])
+					execute_lane(lane, opcode, id);
+			}
+			continue;
+		}
+#endif
+
+		_ready[first] = 0;
+		--pending;
+		execute_lane(first, opcode, id);
+	}
+	return executed;
+}
+
+// Scalar fetch for lanes [begin, end)
+template <unsigned int N>
+void chip8_batch<N>::fetch_lanes(unsigned int begin, unsigned int end, unsigned int& executed, unsigned int& pending)
+{
+	for (unsigned int lane = begin; lane < end; ++lane) {
+		_ready[lane] = 0;
+		if (!_active[lane])
+			continue;
+		++executed;
+
+		// Parked on Fx0A, the instruction's time passes and nothing else
+		if (_halted[lane] && !resume(lane)) {
+			retire(lane, chip8::ID_Fx0A);
+			continue;
+		}
+
+		uint16_t address = _pc[lane] & 0xFFFu;
+		_opcode[lane] = static_cast<uint16_t>((memory(lane, address) << 8) | memory(lane, address + 1));
+		_ready[lane] = 0xFF;
+		++pending;
+	}
+}
+
+// Fetches the next opcode of every active lane and marks it ready. Where a
+// whole vector of lanes shares a PC, both opcode bytes of all of them are
+// one load each.
+template <unsigned int N>
+template <typename S>
+void chip8_batch<N>::fetch(unsigned int& executed, unsigned int& pending)
+{
+	typedef typename S::V V;
+
+	for (unsigned int c = 0; c < N; c += S::LANES) {
+		V active = S::load(&_active[c]);
+		V halted = S::and_(active, S::not_(S::eq8(S::load(&_halted[c]), S::zero())));
+		V pc = S::set16(_pc[c]);
+		V same = S::and_(S::eq16(S::load(&_pc[c]), pc), S::eq16(S::load(&_pc[c + S::LANES / 2]), pc));
+
+		if (S::any(halted) || !S::all(same)) {
+			fetch_lanes(c, c + S::LANES, executed, pending);
+			continue;
+		}
+
+		unsigned int count = S::count(active);
+		executed += count;
+		pending += count;
+		S::store(&_ready[c], active);
+		if (count == 0)
+			continue;
+
+		uint16_t address = _pc[c] & 0xFFFu;
+		V high = S::load(&_memory[address * N + c]);
+		V low = S::load(&_memory[((address + 1) & 0xFFFu) * N + c]);
+		for (unsigned int h = 0; h < 2; ++h)
+			S::store(&_opcode[c + h * S::LANES / 2], S::or_(S::shl16(S::widen16(high, h), 8), S::widen16(low, h)));
+	}
+}
+
+// Moves the ready lanes holding `opcode` into _group, returning how many there are
+template <unsigned int N>
+template <typename S>
+unsigned int chip8_batch<N>::select(uint16_t opcode, unsigned int first)
+{
+	typedef typename S::V V;
+
+	unsigned int begin = first - first % S::LANES;
+	memset(_group, 0, begin);
+
+	V op = S::set16(opcode);
+	unsigned int count = 0;
+	for (unsigned int c = begin; c < N; c += S::LANES) {
+		V ready = S::load(&_ready[c]);
+		V member = S::and_(ready, S::narrow16(S::eq16(S::load(&_opcode[c]), op), S::eq16(S::load(&_opcode[c + S::LANES / 2]), op)));
+		S::store(&_group[c], member);
+		S::store(&_ready[c], S::xor_(ready, member));
+		count += S::count(member);
+	}
+	return count;
+}
+
+// Completes a pending Fx0A with the lowest key held
+template <unsigned int N>
+bool chip8_batch<N>::resume(unsigned int lane)
+{
+	for (uint8_t key = 0; key < 16; ++key) {
+		if (_keypad[key][lane]) {
+			_register[_halt_register[lane]][lane] = key;
+			_halted[lane] = 0;
+			return true;
+		}
+	}
+	return false;
+}
+
+template <unsigned int N>
+void chip8_batch<N>::retire(unsigned int lane, uint8_t id)
+{
+	_countdown[lane] -= static_cast<int32_t>(_costs[id]);
+	if (_countdown[lane] <= 0)
+		tick_timers(lane);
+	if (_events[lane] & _stop_on)
+		_active[lane] = 0;
+}
+
+template <unsigned int N>
+void chip8_batch<N>::tick_timers(unsigned int lane)
+{
+	// Every 60 Hz boundary the clock has passed, usually just the one
+	uint32_t ticks = static_cast<uint32_t>(-_countdown[lane] / _tick_period + 1);
+	_countdown[lane] += static_cast<int32_t>(ticks) * _tick_period;
+	_events[lane] |= chip8::EVENT_TIMER;
+
+	_delay_timer[lane] = static_cast<uint8_t>(_delay_timer[lane] > ticks ? _delay_timer[lane] - ticks : 0);
+
+	if (_sound_timer[lane] > 0) {
+		if (_sound_timer[lane] <= ticks) {
+			_sound_timer[lane] = 0;
+			_events[lane] |= chip8::EVENT_SOUND;
+		}
+		else {
+			_sound_timer[lane] = static_cast<uint8_t>(_sound_timer[lane] - ticks);
+		}
+	}
+}
+
+// Instructions with a group kernel
+template <unsigned int N>
+constexpr bool chip8_batch<N>::vectorised(uint8_t id)
+{
+#if defined(CHIP8_BATCH_AVX2) || defined(CHIP8_BATCH_SSE2)
+	switch (id) {
+	case chip8::ID_NULL: case chip8::ID_00EE: case chip8::ID_2nnn:
+	case chip8::ID_1nnn: case chip8::ID_3xkk: case chip8::ID_4xkk: case chip8::ID_5xy0:
+	case chip8::ID_6xkk: case chip8::ID_7xkk: case chip8::ID_8xy0: case chip8::ID_8xy1:
+	case chip8::ID_8xy2: case chip8::ID_8xy3: case chip8::ID_8xy4: case chip8::ID_8xy5:
+	case chip8::ID_8xy6: case chip8::ID_8xy7: case chip8::ID_8xyE: case chip8::ID_9xy0:
+	case chip8::ID_Annn: case chip8::ID_Ex9E: case chip8::ID_ExA1:
+	case chip8::ID_Fx07: case chip8::ID_Fx15: case chip8::ID_Fx1E:
+	case chip8::ID_Fx29:
+		return true;
+#if defined(CHIP8_BATCH_AVX2)
+	case chip8::ID_Dxyn:
+		return true;
+#endif
+	}
+#endif
+	(void)id;
+	return false;
+}
+
+// One instruction on every lane in _group, as vectors of S::LANES lanes. Same
+// semantics as the chip8 handlers, including the order flags are written in
+// when x or y is F.
+template <unsigned int N>
+template <typename S>
+void chip8_batch<N>::execute_group(uint16_t opcode, uint8_t id)
+{
+	typedef typename S::V V;
+
+	const uint8_t x = (opcode & 0x0F00u) >> 8;
+	const uint8_t y = (opcode & 0x00F0u) >> 4;
+	const uint8_t kk = opcode & 0x00FFu;
+	const uint16_t nnn = opcode & 0x0FFFu;
+	const V one = S::set8(1);
+
+	for (unsigned int c = 0; c < N; c += S::LANES) {
+		V m = S::load(&_group[c]);
+		if (!S::any(m))
+			continue;
+
+		uint8_t* vx = &_register[x][c];
+		uint8_t* vy = &_register[y][c];
+		uint8_t* vf = &_register[0xF][c];
+		V skip = S::zero();
+
+		// Calls and returns need every lane of the vector at the same stack depth
+		uint8_t slot = 0;
+		if (id == chip8::ID_2nnn || id == chip8::ID_00EE) {
+			unsigned int lead = c;
+			while (!_group[lead])
+				++lead;
+
+			uint8_t sp = _sp[lead];
+			if (!S::all(S::or_(S::eq8(S::load(&_sp[c]), S::set8(sp)), S::not_(m)))) {
+				execute_lanes(c, S::LANES, opcode, id);
+				continue;
+			}
+
+			// The slot written by a call, or read by a return
+			slot = id == chip8::ID_2nnn ? sp : (sp - 1) & 0xFu;
+			S::store(&_sp[c], S::blend(m, S::set8(id == chip8::ID_2nnn ? (sp + 1) & 0xFu : slot), S::load(&_sp[c])));
+		}
+
+		switch (id) {
+		case chip8::ID_3xkk: skip = S::eq8(S::load(vx), S::set8(kk)); break;
+		case chip8::ID_4xkk: skip = S::not_(S::eq8(S::load(vx), S::set8(kk))); break;
+		case chip8::ID_5xy0: skip = S::eq8(S::load(vx), S::load(vy)); break;
+		case chip8::ID_9xy0: skip = S::not_(S::eq8(S::load(vx), S::load(vy))); break;
+		case chip8::ID_6xkk: S::store(vx, S::blend(m, S::set8(kk), S::load(vx))); break;
+		case chip8::ID_7xkk: S::store(vx, S::blend(m, S::add8(S::load(vx), S::set8(kk)), S::load(vx))); break;
+		case chip8::ID_8xy0: S::store(vx, S::blend(m, S::load(vy), S::load(vx))); break;
+		case chip8::ID_8xy1: S::store(vx, S::blend(m, S::or_(S::load(vx), S::load(vy)), S::load(vx))); break;
+		case chip8::ID_8xy2: S::store(vx, S::blend(m, S::and_(S::load(vx), S::load(vy)), S::load(vx))); break;
+		case chip8::ID_8xy3: S::store(vx, S::blend(m, S::xor_(S::load(vx), S::load(vy)), S::load(vx))); break;
+
+		case chip8::ID_8xy4: {
+			// Carry out where the saturating sum differs from the wrapping one
+			V a = S::load(vx), b = S::load(vy), sum = S::add8(a, b);
+			S::store(vf, S::blend(m, S::and_(S::not_(S::eq8(S::adds8(a, b), sum)), one), S::load(vf)));
+			S::store(vx, S::blend(m, sum, S::load(vx)));
+			break;
+		}
+		case chip8::ID_8xy5: {
+			V greater = S::not_(S::eq8(S::subs8(S::load(vx), S::load(vy)), S::zero()));
+			S::store(vf, S::blend(m, S::and_(greater, one), S::load(vf)));
+			S::store(vx, S::blend(m, S::sub8(S::load(vx), S::load(vy)), S::load(vx)));
+			break;
+		}
+		case chip8::ID_8xy6:
+			S::store(vf, S::blend(m, S::and_(S::load(vx), one), S::load(vf)));
+			S::store(vx, S::blend(m, S::shr8(S::load(vx), 1), S::load(vx)));
+			break;
+		case chip8::ID_8xy7: {
+			V greater = S::not_(S::eq8(S::subs8(S::load(vy), S::load(vx)), S::zero()));
+			S::store(vf, S::blend(m, S::and_(greater, one), S::load(vf)));
+			S::store(vx, S::blend(m, S::sub8(S::load(vy), S::load(vx)), S::load(vx)));
+			break;
+		}
+		case chip8::ID_8xyE:
+			S::store(vf, S::blend(m, S::shr8(S::load(vx), 7), S::load(vf)));
+			S::store(vx, S::blend(m, S::add8(S::load(vx), S::load(vx)), S::load(vx)));
+			break;
+
+		case chip8::ID_Ex9E:
+		case chip8::ID_ExA1: {
+			// One keypad array per key, so test every key against the one each lane's Vx names
+			V key = S::and_(S::load(vx), S::set8(0xF));
+			V pressed = S::zero();
+			for (uint8_t k = 0; k < 16; ++k)
+				pressed = S::or_(pressed, S::and_(S::eq8(key, S::set8(k)), S::load(&_keypad[k][c])));
+			pressed = S::not_(S::eq8(pressed, S::zero()));
+			skip = id == chip8::ID_Ex9E ? pressed : S::not_(pressed);
+			break;
+		}
+
+#if defined(CHIP8_BATCH_AVX2)
+		case chip8::ID_Dxyn:
+			if (!draw_avx2(c, opcode)) {
+				execute_lanes(c, S::LANES, opcode, id);
+				continue;
+			}
+			break;
+#endif
+
+		case chip8::ID_Fx07: S::store(vx, S::blend(m, S::load(&_delay_timer[c]), S::load(vx))); break;
+		case chip8::ID_Fx15: S::store(&_delay_timer[c], S::blend(m, S::load(vx), S::load(&_delay_timer[c]))); break;
+		}
+
+		// Program counter and I, two word vectors per byte vector
+		V taken = S::and_(skip, m);
+		for (unsigned int h = 0; h < 2; ++h) {
+			unsigned int lane = c + h * S::LANES / 2;
+			V m16 = S::mask16(m, h);
+
+			V pc = S::load(&_pc[lane]);
+			V next;
+			if (id == chip8::ID_1nnn) {
+				next = S::set16(nnn);
+			}
+			else if (id == chip8::ID_2nnn) {
+				V link = S::add16(pc, S::set16(2));
+				S::store(&_stack[slot][lane], S::blend(m16, link, S::load(&_stack[slot][lane])));
+				next = S::set16(nnn);
+			}
+			else if (id == chip8::ID_00EE) {
+				next = S::load(&_stack[slot][lane]);
+			}
+			else {
+				next = S::add16(pc, S::add16(S::set16(2), S::and_(S::mask16(taken, h), S::set16(2))));
+			}
+			S::store(&_pc[lane], S::blend(m16, next, pc));
+
+			if (id == chip8::ID_Annn || id == chip8::ID_Fx1E || id == chip8::ID_Fx29) {
+				V index = S::load(&_index[lane]);
+				V value;
+				if (id == chip8::ID_Annn)
+					value = S::set16(nnn);
+				else if (id == chip8::ID_Fx1E)
+					value = S::add16(index, S::widen16(S::load(vx), h));
+				else
+					value = S::add16(S::set16(FONTSET_START_ADDRESS), S::mul16(S::widen16(S::load(vx), h), S::set16(5)));
+				S::store(&_index[lane], S::blend(m16, value, index));
+			}
+		}
+
+		// Clock, four dword vectors per byte vector. Ticks are rare and done per lane.
+		V cost = S::set32(static_cast<int32_t>(_costs[id]));
+		V due = S::zero();
+		for (unsigned int q = 0; q < 4; ++q) {
+			unsigned int lane = c + q * S::LANES / 4;
+			V countdown = S::sub32(S::load(&_countdown[lane]), S::and_(S::mask32(m, q), cost));
+			S::store(&_countdown[lane], countdown);
+			due = S::or_(due, S::gt32(S::set32(1), countdown));
+		}
+		if (S::any(due)) {
+			for (unsigned int lane = c; lane < c + S::LANES; ++lane) {
+				if (_countdown[lane] <= 0)
+					tick_timers(lane);
+				if (_group[lane] && (_events[lane] & _stop_on))
+					_active[lane] = 0;
+			}
+		}
+	}
+}
+
+// Group lanes in [begin, begin + count) that a kernel can't take, one at a time
+template <unsigned int N>
+void chip8_batch<N>::execute_lanes(unsigned int begin, unsigned int count, uint16_t opcode, uint8_t id)
+{
+	for (unsigned int lane = begin; lane < begin + count; ++lane) {
+		if (_group[lane]) {
+			--_vector_instructions;
+			execute_lane(lane, opcode, id);
+		}
+	}
+}
+
+#if defined(CHIP8_BATCH_AVX2)
+// Dxyn for the group lanes of one vector. They must agree on Vy and I, so
+// every lane draws the same display rows from the same addresses and only
+// the x shift differs. Returns false to leave disagreeing lanes to execute_lane().
+template <unsigned int N>
+bool chip8_batch<N>::draw_avx2(unsigned int c, uint16_t opcode)
+{
+	const uint8_t x = (opcode & 0x0F00u) >> 8;
+	const uint8_t y = (opcode & 0x00F0u) >> 4;
+	const uint8_t n = opcode & 0x000Fu;
+
+	unsigned int lead = c;
+	while (!_group[lead])
+		++lead;
+
+	__m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&_group[c]));
+	__m256i not_m = _mm256_xor_si256(m, _mm256_set1_epi8(-1));
+	__m256i same_y = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(&_register[y][c])), _mm256_set1_epi8(static_cast<char>(_register[y][lead])));
+	if (_mm256_movemask_epi8(_mm256_or_si256(same_y, not_m)) != -1)
+		return false;
+	for (unsigned int h = 0; h < 2; ++h) {
+		__m256i same_i = _mm256_cmpeq_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(&_index[c + 16 * h])), _mm256_set1_epi16(static_cast<short>(_index[lead])));
+		if (_mm256_movemask_epi8(_mm256_or_si256(same_i, batch_avx2::mask16(not_m, h))) != -1)
+			return false;
+	}
+
+	unsigned int yPos = _register[y][lead] % 32;
+	uint16_t index = _index[lead];
+	unsigned int height = _sprite_wrap ? n : std::min(n + yPos, 32u) - yPos;
+
+	// Per lane shifts and lane masks, four lanes to a vector
+	__m256i shift[8], unshift[8], lanes[8], collision[8];
+	for (unsigned int q = 0; q < 8; ++q) {
+		int32_t xs, ms;
+		memcpy(&xs, &_register[x][c + 4 * q], 4);
+		memcpy(&ms, &_group[c + 4 * q], 4);
+		shift[q] = _mm256_and_si256(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(xs)), _mm256_set1_epi64x(63));
+		unshift[q] = _mm256_and_si256(_mm256_sub_epi64(_mm256_set1_epi64x(64), shift[q]), _mm256_set1_epi64x(63));
+		lanes[q] = _mm256_cvtepi8_epi64(_mm_cvtsi32_si128(ms));
+		collision[q] = _mm256_setzero_si256();
+	}
+
+	for (unsigned int row = 0; row < height; ++row) {
+		const uint8_t* bytes = &_memory[((index + row) & 0xFFFu) * N + c];
+		unsigned int line = (yPos + row) % 32;
+
+		for (unsigned int q = 0; q < 8; ++q) {
+			int32_t word;
+			memcpy(&word, &bytes[4 * q], 4);
+			__m256i sprite = _mm256_slli_epi64(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(word)), 56);
+
+			// A right rotation wraps the columns past x = 63, a shift drops them
+			if (_sprite_wrap)
+				sprite = _mm256_or_si256(_mm256_srlv_epi64(sprite, shift[q]), _mm256_sllv_epi64(sprite, unshift[q]));
+			else
+				sprite = _mm256_srlv_epi64(sprite, shift[q]);
+			sprite = _mm256_and_si256(sprite, lanes[q]);
+
+			__m256i* display = reinterpret_cast<__m256i*>(&_display[line][c + 4 * q]);
+			__m256i pixels = _mm256_loadu_si256(display);
+			collision[q] = _mm256_or_si256(collision[q], _mm256_and_si256(pixels, sprite));
+			_mm256_storeu_si256(display, _mm256_xor_si256(pixels, sprite));
+
+			int drawn = ~_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(sprite, _mm256_setzero_si256()))) & 0xF;
+			for (unsigned int i = 0; drawn; ++i, drawn >>= 1) {
+				if (drawn & 1)
+					_dirty_rows[c + 4 * q + i] |= 1u << line;
+			}
+		}
+	}
+
+	for (unsigned int q = 0; q < 8; ++q) {
+		int hit = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(collision[q], _mm256_setzero_si256())));
+		for (unsigned int i = 0; i < 4; ++i) {
+			unsigned int lane = c + 4 * q + i;
+			if (!_group[lane])
+				continue;
+			_register[0xF][lane] = !((hit >> i) & 1);
+			_events[lane] |= chip8::EVENT_DRAW;
+			if (_events[lane] & _stop_on)
+				_active[lane] = 0;
+		}
+	}
+	return true;
+}
+#endif
+
+// One instruction on one lane, the reference the group kernels must agree with
+template <unsigned int N>
+void chip8_batch<N>::execute_lane(unsigned int lane, uint16_t opcode, uint8_t id)
+{
+	++_scalar_instructions;
+
+	const uint8_t x = (opcode & 0x0F00u) >> 8;
+	const uint8_t y = (opcode & 0x00F0u) >> 4;
+	const uint8_t n = opcode & 0x000Fu;
+	const uint8_t kk = opcode & 0x00FFu;
+	const uint16_t nnn = opcode & 0x0FFFu;
+	uint8_t& vx = _register[x][lane];
+	uint8_t& vy = _register[y][lane];
+	uint8_t& vf = _register[0xF][lane];
+	uint16_t& pc = _pc[lane];
+	uint16_t& index = _index[lane];
+
+	pc += 2;
+
+	switch (id) {
+	case chip8::ID_00E0:
+		for (unsigned int row = 0; row < 32; ++row)
+			_display[row][lane] = 0;
+		_dirty_rows[lane] = 0xFFFFFFFF;
+		_events[lane] |= chip8::EVENT_DRAW;
+		break;
+	case chip8::ID_00EE:
+		_sp[lane] = (_sp[lane] - 1) & 0xFu;
+		pc = _stack[_sp[lane]][lane];
+		break;
+	case chip8::ID_1nnn: pc = nnn; break;
+	case chip8::ID_2nnn:
+		_stack[_sp[lane]][lane] = pc;
+		_sp[lane] = (_sp[lane] + 1) & 0xFu;
+		pc = nnn;
+		break;
+	case chip8::ID_3xkk: if (vx == kk) pc += 2; break;
+	case chip8::ID_4xkk: if (vx != kk) pc += 2; break;
+	case chip8::ID_5xy0: if (vx == vy) pc += 2; break;
+	case chip8::ID_6xkk: vx = kk; break;
+	case chip8::ID_7xkk: vx += kk; break;
+	case chip8::ID_8xy0: vx = vy; break;
+	case chip8::ID_8xy1: vx |= vy; break;
+	case chip8::ID_8xy2: vx &= vy; break;
+	case chip8::ID_8xy3: vx ^= vy; break;
+	case chip8::ID_8xy4: {
+		uint16_t sum = vx + vy;
+		vf = sum > 255u;
+		vx = sum & 0xFFu;
+		break;
+	}
+	case chip8::ID_8xy5: vf = vx > vy; vx -= vy; break;
+	case chip8::ID_8xy6: vf = vx & 0x1u; vx >>= 1; break;
+	case chip8::ID_8xy7: vf = vy > vx; vx = vy - vx; break;
+	case chip8::ID_8xyE: vf = (vx & 0x80u) >> 7; vx <<= 1; break;
+	case chip8::ID_9xy0: if (vx != vy) pc += 2; break;
+	case chip8::ID_Annn: index = nnn; break;
+	case chip8::ID_Bnnn: pc = _register[0][lane] + nnn; break;
+	case chip8::ID_Cxkk: vx = chip8::random_byte(_random[lane]) & kk; break;
+
+	case chip8::ID_Dxyn: {
+		unsigned int xPos = vx % 64;
+		unsigned int yPos = vy % 32;
+		unsigned int height = _sprite_wrap ? n : std::min(n + yPos, 32u) - yPos;
+		uint64_t collision = 0;
+
+		for (unsigned int row = 0; row < height; ++row) {
+			uint64_t sprite = static_cast<uint64_t>(memory(lane, index + row)) << 56;
+			if (_sprite_wrap)
+				sprite = (sprite >> xPos) | (sprite << ((64 - xPos) & 63u));
+			else
+				sprite >>= xPos;
+
+			unsigned int line = (yPos + row) % 32;
+			collision |= _display[line][lane] & sprite;
+			_display[line][lane] ^= sprite;
+			if (sprite)
+				_dirty_rows[lane] |= 1u << line;
+		}
+
+		vf = collision != 0;
+		_events[lane] |= chip8::EVENT_DRAW;
+		break;
+	}
+
+	case chip8::ID_Ex9E: if (_keypad[vx & 0xFu][lane]) pc += 2; break;
+	case chip8::ID_ExA1: if (!_keypad[vx & 0xFu][lane]) pc += 2; break;
+	case chip8::ID_Fx07: vx = _delay_timer[lane]; break;
+	case chip8::ID_Fx0A:
+		_halt_register[lane] = x;
+		_halted[lane] = 1;
+		if (!resume(lane))
+			_events[lane] |= chip8::EVENT_KEY_WAIT;
+		break;
+	case chip8::ID_Fx15: _delay_timer[lane] = vx; break;
+	case chip8::ID_Fx18:
+		if ((_sound_timer[lane] == 0) != (vx == 0))
+			_events[lane] |= chip8::EVENT_SOUND;
+		_sound_timer[lane] = vx;
+		break;
+	case chip8::ID_Fx1E: index += vx; break;
+	case chip8::ID_Fx29: index = FONTSET_START_ADDRESS + 5 * vx; break;
+	case chip8::ID_Fx33:
+		memory(lane, index + 2) = vx % 10;
+		memory(lane, index + 1) = (vx / 10) % 10;
+		memory(lane, index) = vx / 100;
+		break;
+	case chip8::ID_Fx55:
+		for (uint8_t i = 0; i <= x; ++i)
+			memory(lane, index + i) = _register[i][lane];
+		break;
+	case chip8::ID_Fx65:
+		for (uint8_t i = 0; i <= x; ++i)
+			_register[i][lane] = memory(lane, index + i);
+		break;
+	}
+
+	retire(lane, id);
+}
+
+#endif // !BATCH_H
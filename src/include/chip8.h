@@ -1,14 +1,78 @@
 #ifndef CHIP8_H
 #define CHIP8_H
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+
+// Dispatch backends, selected at compile time with -DCHIP8_DISPATCH=<backend>.
+#define CHIP8_DISPATCH_TABLE     0	// member-function pointer tables (default)
+#define CHIP8_DISPATCH_SWITCH    1	// switch over the decoded instruction
+#define CHIP8_DISPATCH_GOTO      2	// computed-goto threaded interpreter (GCC/Clang)
+#define CHIP8_DISPATCH_MUSTTAIL  3	// tail-call threaded interpreter
+#define CHIP8_DISPATCH_DECODE64K 4	// 65536-entry opcode -> handler table
+#define CHIP8_DISPATCH_PREDECODE 5	// lazily predecoded shadow of memory
+
+#ifndef CHIP8_DISPATCH
+#define CHIP8_DISPATCH CHIP8_DISPATCH_TABLE
+#endif
+
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_TABLE
+#define CHIP8_DISPATCH_NAME "table"
+#elif CHIP8_DISPATCH == CHIP8_DISPATCH_SWITCH
+#define CHIP8_DISPATCH_NAME "switch"
+#elif CHIP8_DISPATCH == CHIP8_DISPATCH_GOTO
+#define CHIP8_DISPATCH_NAME "goto"
+#if !defined(__GNUC__)
+#error "CHIP8_DISPATCH_GOTO needs the GNU labels-as-values extension"
+#endif
+#elif CHIP8_DISPATCH == CHIP8_DISPATCH_MUSTTAIL
+#define CHIP8_DISPATCH_NAME "musttail"
+#elif CHIP8_DISPATCH == CHIP8_DISPATCH_DECODE64K
+#define CHIP8_DISPATCH_NAME "decode64k"
+#elif CHIP8_DISPATCH == CHIP8_DISPATCH_PREDECODE
+#define CHIP8_DISPATCH_NAME "predecode"
+#else
+#error "Unknown CHIP8_DISPATCH backend"
+#endif
+
+// Handlers only chain into each other when the tail call is guaranteed.
+// Otherwise every instruction would nest one call deeper (unoptimised builds
+// overflow the stack), so run() trampolines through tail_next() instead.
+#if defined(__has_cpp_attribute)
+#if __has_cpp_attribute(clang::musttail)
+#define CHIP8_MUSTTAIL [[clang::musttail]]
+#define CHIP8_HAS_MUSTTAIL
+#elif __has_cpp_attribute(gnu::musttail)
+#define CHIP8_MUSTTAIL [[gnu::musttail]]
+#define CHIP8_HAS_MUSTTAIL
+#endif
+#endif
+#ifndef CHIP8_MUSTTAIL
+#define CHIP8_MUSTTAIL
+#endif
+
+// Every instruction the core implements, in decode order.
+#define CHIP8_INSTRUCTIONS(X) \
+	X(00E0) X(00EE) X(1nnn) X(2nnn) X(3xkk) X(4xkk) X(5xy0) X(6xkk) X(7xkk) \
+	X(8xy0) X(8xy1) X(8xy2) X(8xy3) X(8xy4) X(8xy5) X(8xy6) X(8xy7) X(8xyE) \
+	X(9xy0) X(Annn) X(Bnnn) X(Cxkk) X(Dxyn) X(Ex9E) X(ExA1) X(Fx07) X(Fx0A) \
+	X(Fx15) X(Fx18) X(Fx1E) X(Fx29) X(Fx33) X(Fx55) X(Fx65)
 
 const unsigned int START_ADDRESS = 0x200;
 const unsigned int FONTSET_START_ADDRESS = 0x50;
 const unsigned int FONTSET_SIZE = 80;
+const unsigned int TIMER_FREQUENCY = 60;
+const unsigned int DEFAULT_INSTRUCTIONS_PER_SECOND = 600;
 
-uint8_t fontset[FONTSET_SIZE] =
+constexpr uint8_t fontset[FONTSET_SIZE] =
 {
 	0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
 	0x20, 0x60, 0x20, 0x20, 0x70, // 1
@@ -29,74 +93,335 @@ uint8_t fontset[FONTSET_SIZE] =
 };
 
 class chip8 {
-public:
-	chip8();
+	friend class chip8_jit;
+	friend class chip8_aot;
+	template <unsigned int> friend class chip8_batch;
 
-	void load_rom(const char*);
-	void cycle();
+public:
+	inline chip8();
+
+	inline void load_rom(const char*);
+	inline void load_rom(const uint8_t* data, size_t size);
+	inline void cycle();
+
+	// Things the embedder may need to react to, reported by run()
+	enum Event : uint8_t {
+		EVENT_NONE     = 0,
+		EVENT_DRAW     = 1 << 0,	// 00E0 or Dxyn changed the display
+		EVENT_SOUND    = 1 << 1,	// the sound timer started or stopped
+		EVENT_KEY_WAIT = 1 << 2,	// Fx0A is waiting for a key press
+		EVENT_TIMER    = 1 << 3,	// a 60 Hz timer tick passed on the emulated clock
+	};
+
+	// Runs up to `cycles` instructions, returning early after any instruction
+	// that raises one of the events in `stop_on`. Returns the number executed.
+	inline uint64_t run(uint64_t cycles, uint8_t stop_on = EVENT_DRAW | EVENT_SOUND | EVENT_KEY_WAIT);
+
+	// Runs until the next 60 Hz timer tick, one frame of emulated time
+	inline uint64_t run_until_frame();
+
+	// Emulated clock. Every instruction costs a fixed time and the timers tick
+	// at 60 Hz of that time, so speed doesn't depend on the host. Either a flat
+	// rate, or the per-opcode durations of the COSMAC VIP interpreter.
+	// Changing it restarts the current timer period.
+	inline void set_speed(uint32_t instructions_per_second);
+	inline void set_vip_timing();
+
+	// Events raised by the last call to run(), run_until_frame() or cycle()
+	uint8_t events() const { return _events & ~EVENT_IDLE; }
+
+	// Keypad input. A press releases a CPU parked on Fx0A straight away.
+	inline void press_key(uint8_t key);
+	void release_key(uint8_t key) { _keypad[key & 0xFu] = 0; }
+
+	// Parked on Fx0A, only the timers advance until a key is pressed
+	bool halted() const { return _halted; }
+	bool timers_active() const { return _delay_timer > 0 || _sound_timer > 0; }
+
+	// Cxkk draws from a generator owned by the VM, so the same seed gives the
+	// same run whatever other VMs in the process are doing
+	void set_seed(uint32_t seed) { _random = seed; }
+
+	// Notified after the core writes to memory, so caches of translated code can drop stale entries
+	typedef void (*WriteHook)(void* user, uint16_t address, size_t length);
+	void set_write_hook(WriteHook hook, void* user) { _write_hook = hook; _write_hook_user = user; }
+
+	// Display, one row per word with x = 0 in the most significant bit
+	const uint64_t* display() const { return _display; }
+	bool pixel(unsigned int x, unsigned int y) const { return (_display[y % 32] >> (63 - x % 64)) & 1u; }
+
+	// Expands the display to 64x32 RGBA words, bottom row first to match
+	// OpenGL's texture origin. Colours are stored as given.
+	inline void render(uint32_t* out, uint32_t on = 0xFFFFFFFF, uint32_t off = 0xFF000000) const;
+
+	// Rows drawn to since the last call, bit y for row y. Everything starts dirty.
+	uint32_t take_dirty_rows() { uint32_t rows = _dirty_rows; _dirty_rows = 0; return rows; }
+
+	// Sprites are clipped at the screen edge by default. With wrapping on,
+	// they continue on the opposite side instead.
+	void set_sprite_wrap(bool enabled) { _sprite_wrap = enabled; }
+	bool sprite_wrap() const { return _sprite_wrap; }
+
+	// Snapshot of everything a run depends on except the clock settings,
+	// quirks and hooks, for branching a VM many times over (tree search).
+	class State;
+
+	// fork() snapshots the VM. Memory is kept as 256-byte copy-on-write
+	// pages: the pages the VM hasn't written since it was last restored
+	// from or forked into `parent` are shared with it, not copied.
+	inline State fork();
+	inline State fork(const State& parent);
+
+	// Puts the VM back in a forked state, copying only the pages that differ
+	inline void restore(const State& state);
 
-	uint32_t _video[64 * 32]{ 0x000000FF };
 	uint8_t  _keypad[16]{ 0 };
 
+#define CHIP8_ID(name) ID_##name,
+	// Instruction identifiers, ID_NULL for anything undefined
+	enum InstructionId : uint8_t { ID_NULL, CHIP8_INSTRUCTIONS(CHIP8_ID) ID_COUNT };
+#undef CHIP8_ID
+
+	static constexpr uint8_t decode(uint16_t opcode);
+
+	// Superinstruction fusion, only implemented by the predecode backend.
+	// Turning it off gives plain dispatch for differential testing.
+	void set_fusion(bool enabled) { _fusion = enabled; }
+	bool fusion() const { return _fusion; }
+
+	// Instructions executed in total, and how many of them ran inside a fused handler
+	uint64_t instructions() const { return _instructions; }
+	uint64_t fused_instructions() const { return _fused_instructions; }
+
 private:
-	uint8_t  _memory[4096];
-	uint8_t  _register[16];
-	uint16_t _stack[16];
+	uint64_t _display[32]{ 0 };
+	uint32_t _dirty_rows{ 0xFFFFFFFF };
+	bool     _sprite_wrap{ false };
+	uint8_t  _memory[4096]{ 0 };
+	uint8_t  _register[16]{ 0 };
+	uint16_t _stack[16]{ 0 };
 	uint16_t _pc;
-	uint8_t  _sp;
-	uint8_t  _delay_timer;
-	uint8_t  _sound_timer;
-	uint16_t _opcode;
-	uint16_t _index;
+	uint8_t  _sp{ 0 };
+	uint8_t  _delay_timer{ 0 };
+	uint8_t  _sound_timer{ 0 };
+	uint16_t _opcode{ 0 };
+	uint16_t _index{ 0 };
+	uint32_t _random{ 1 };
+
+	// Pages written since memory last matched the state with id _base_state, bit n for page n
+	uint16_t _dirty_pages{ 0xFFFF };
+	uint64_t _base_state{ 0 };
+
+	uint8_t   _events{ EVENT_NONE };
+	static constexpr uint8_t EVENT_IDLE = 1 << 7;	// internal, a spin loop execute() can skip
+	bool      _halted{ false };
+	uint8_t   _halt_register{ 0 };
+
+	// Instruction costs and the timer period are in units of the emulated clock
+	uint32_t _costs[ID_COUNT]{ 0 };
+	uint64_t _tick_period{ 0 };
+	uint64_t _time{ 0 };
+	uint64_t _next_tick{ 0 };
+	WriteHook _write_hook{ nullptr };
+	void*     _write_hook_user{ nullptr };
+
+	bool     _fusion{ CHIP8_DISPATCH == CHIP8_DISPATCH_PREDECODE };
+	uint64_t _instructions{ 0 };
+	uint64_t _fused_instructions{ 0 };
+
+	uint16_t opcode_at(uint16_t address) const { return (_memory[address & 0xFFFu] << 8) | _memory[(address + 1) & 0xFFFu]; }
+	uint16_t fetch() const { return opcode_at(_pc); }
+	inline uint64_t execute(uint64_t count, uint8_t stop_on);
+	inline uint64_t dispatch(uint64_t count, uint8_t stop_on);
+	inline uint64_t wait_for_key(uint64_t count, uint8_t stop_on);
+	inline bool resume();
+	inline uint64_t idle(uint64_t count, uint32_t cost, uint8_t stop_on);
+	inline bool idle_loop(uint16_t target, uint16_t from) const;
+	inline uint64_t skip_idle(uint64_t count, uint8_t stop_on);
+	inline void execute_opcode(uint16_t opcode);
+	void retire(uint8_t id) { _time += _costs[id]; if (_time >= _next_tick) tick_timers(); }
+	inline void tick_timers();
+	inline uint64_t stop_time(uint8_t stop_on) const;
+	static constexpr uint32_t vip_microseconds(uint8_t id);
+	inline void memory_written(uint16_t address, size_t length);
+
+	// 32-bit LCG, the top byte is the best distributed
+	static uint8_t random_byte(uint32_t& state) { state = state * 1664525u + 1013904223u; return static_cast<uint8_t>(state >> 24); }
+
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_PREDECODE
+	// One slot per address, so jumps to odd addresses still hit the cache
+	struct Decoded {
+		uint8_t  id;
+		uint8_t  x;
+		uint8_t  y;
+		uint8_t  n;
+		uint8_t  kk;
+		uint8_t  fused;
+		uint16_t nnn;
+	};
+	static constexpr uint8_t ID_UNDECODED = 0xFF;
+
+	// Idioms that run as one handler when the slot after them still matches
+	enum Fusion : uint8_t {
+		FUSED_NONE,
+		FUSED_ANNN_DXYN,	// Annn, Dxyn: point I at a sprite and draw it
+		FUSED_6XKK_6YKK,	// 6xkk, 6ykk: load a pair of registers
+		FUSED_SKIP_1NNN,	// 3xkk or 4xkk, 1nnn: conditional branch
+		FUSED_TIMER_POLL,	// Fx07, 3x00, 1nnn: wait for the delay timer
+	};
+	// Bytes a fused slot may depend on past its own two
+	static constexpr unsigned int FUSION_REACH = 4;
+
+	static constexpr Decoded make_decoded(uint16_t opcode)
+	{
+		return { decode(opcode), static_cast<uint8_t>((opcode & 0x0F00u) >> 8),
+			static_cast<uint8_t>((opcode & 0x00F0u) >> 4), static_cast<uint8_t>(opcode & 0x000Fu),
+			static_cast<uint8_t>(opcode & 0x00FFu), FUSED_NONE, static_cast<uint16_t>(opcode & 0x0FFFu) };
+	}
+
+	Decoded        _decoded[4096];
+	uint64_t       _decoded_bitmap[4096 / 64]{ 0 };
+	const Decoded* _insn{ nullptr };
+
+	inline void predecode(uint16_t address);
+	inline void predecode_fused(uint16_t address);
+	inline void invalidate(uint16_t address, size_t length);
+	inline uint64_t execute_fused(uint16_t address, uint64_t count, uint8_t stop_on);
+	inline bool fused_step(uint8_t id, uint64_t& count, uint8_t stop_on);
+	void fused_retire(uint8_t id) { ++_fused_instructions; retire(id); }
+
+	// Operands of the executing instruction
+	uint8_t  op_x() const { return _insn->x; }
+	uint8_t  op_y() const { return _insn->y; }
+	uint8_t  op_n() const { return _insn->n; }
+	uint8_t  op_kk() const { return _insn->kk; }
+	uint16_t op_nnn() const { return _insn->nnn; }
+#else
+	// Operands of the executing instruction
+	uint8_t  op_x() const { return (_opcode & 0x0F00u) >> 8; }
+	uint8_t  op_y() const { return (_opcode & 0x00F0u) >> 4; }
+	uint8_t  op_n() const { return _opcode & 0x000Fu; }
+	uint8_t  op_kk() const { return _opcode & 0x00FFu; }
+	uint16_t op_nnn() const { return _opcode & 0x0FFFu; }
+#endif
 
 	// Instructions
-	void OP_00E0();
-	void OP_00EE();
-	void OP_1nnn();
-	void OP_2nnn();
-	void OP_3xkk();
-	void OP_4xkk();
-	void OP_5xy0();
-	void OP_6xkk();
-	void OP_7xkk();
-	void OP_8xy0();
-	void OP_8xy1();
-	void OP_8xy2();
-	void OP_8xy3();
-	void OP_8xy4();
-	void OP_8xy5();
-	void OP_8xy6();
-	void OP_8xy7();
-	void OP_8xyE();
-	void OP_9xy0();
-	void OP_Annn();
-	void OP_Bnnn();
-	void OP_Cxkk();
-	void OP_Dxyn();
-	void OP_Ex9E();
-	void OP_ExA1();
-	void OP_Fx07();
-	void OP_Fx0A();
-	void OP_Fx15();
-	void OP_Fx18();
-	void OP_Fx1E();
-	void OP_Fx29();
-	void OP_Fx33();
-	void OP_Fx55();
-	void OP_Fx65();
-
-	void Table0();
-	void Table8();
-	void TableE();
-	void TableF();
+	inline void OP_00E0();
+	inline void OP_00EE();
+	inline void OP_1nnn();
+	inline void OP_2nnn();
+	inline void OP_3xkk();
+	inline void OP_4xkk();
+	inline void OP_5xy0();
+	inline void OP_6xkk();
+	inline void OP_7xkk();
+	inline void OP_8xy0();
+	inline void OP_8xy1();
+	inline void OP_8xy2();
+	inline void OP_8xy3();
+	inline void OP_8xy4();
+	inline void OP_8xy5();
+	inline void OP_8xy6();
+	inline void OP_8xy7();
+	inline void OP_8xyE();
+	inline void OP_9xy0();
+	inline void OP_Annn();
+	inline void OP_Bnnn();
+	inline void OP_Cxkk();
+	inline void OP_Dxyn();
+	inline void OP_Ex9E();
+	inline void OP_ExA1();
+	inline void OP_Fx07();
+	inline void OP_Fx0A();
+	inline void OP_Fx15();
+	inline void OP_Fx18();
+	inline void OP_Fx1E();
+	inline void OP_Fx29();
+	inline void OP_Fx33();
+	inline void OP_Fx55();
+	inline void OP_Fx65();
+
+	inline void Table0();
+	inline void Table8();
+	inline void TableE();
+	inline void TableF();
 	void OP_NULL() { }
 
+	// Handler tables, built at compile time and shared by every instance
 	typedef void (chip8::* Chip8Func)();
-	Chip8Func table[0xF + 1]{ &chip8::OP_NULL };
-	Chip8Func table0[0xE + 1]{ &chip8::OP_NULL };
-	Chip8Func table8[0xE + 1]{ &chip8::OP_NULL };
-	Chip8Func tableE[0xE + 1]{ &chip8::OP_NULL };
-	Chip8Func tableF[0x65 + 1]{ &chip8::OP_NULL };
+	template <size_t Size> static constexpr std::array<Chip8Func, Size> make_null_table();
+	static constexpr std::array<Chip8Func, 0xF + 1> make_table();
+	static constexpr std::array<Chip8Func, 0xF + 1> make_table0();
+	static constexpr std::array<Chip8Func, 0xF + 1> make_table8();
+	static constexpr std::array<Chip8Func, 0xF + 1> make_tableE();
+	static constexpr std::array<Chip8Func, 0xFF + 1> make_tableF();
+
+	// Opcode -> InstructionId, shared by the threaded backends
+	static constexpr std::array<uint8_t, 0x10000> make_id_table();
+
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_DECODE64K
+	typedef void (*Handler)(chip8&);
+	template <void (chip8::* F)()> static void thunk(chip8& c) { (c.*F)(); }
+	static constexpr std::array<Handler, 0x10000> make_decode_table();
+#endif
+
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_MUSTTAIL
+	typedef uint64_t (*TailFunc)(chip8&, uint64_t);
+	uint8_t _stop_on{ EVENT_NONE };
+	static inline uint64_t tail_next(chip8& c, uint64_t count);
+	template <void (chip8::* F)(), uint8_t Id> static uint64_t tail_op(chip8& c, uint64_t count);
+#endif
+};
+
+// No per-instance tables or owned resources, so a VM can be copied with memcpy
+static_assert(std::is_trivially_copyable<chip8>::value, "chip8 state must stay trivially copyable");
+
+class chip8::State {
+public:
+	static const unsigned int PAGE_SIZE = 256;
+	static const unsigned int PAGE_COUNT = 4096 / PAGE_SIZE;
+
+	// Pages held in common with another state rather than copied
+	unsigned int shared_pages(const State& other) const
+	{
+		unsigned int shared = 0;
+		for (unsigned int page = 0; page < PAGE_COUNT; ++page)
+			shared += _pages[page] && _pages[page] == other._pages[page];
+		return shared;
+	}
+
+private:
+	friend class chip8;
+
+	struct Page {
+		uint8_t bytes[PAGE_SIZE];
+	};
+
+	std::shared_ptr<const Page> _pages[PAGE_COUNT];
+	uint64_t _id{ 0 };	// 0 for a state that didn't come from fork()
+
+	uint64_t _display[32]{ 0 };
+	uint64_t _time{ 0 };
+	uint64_t _next_tick{ 0 };
+	uint32_t _random{ 0 };
+	uint16_t _stack[16]{ 0 };
+	uint16_t _pc{ 0 };
+	uint16_t _index{ 0 };
+	uint8_t  _register[16]{ 0 };
+	uint8_t  _keypad[16]{ 0 };
+	uint8_t  _sp{ 0 };
+	uint8_t  _delay_timer{ 0 };
+	uint8_t  _sound_timer{ 0 };
+	uint8_t  _events{ 0 };
+	uint8_t  _halt_register{ 0 };
+	bool     _halted{ false };
+
+	// Only compared, never a count of anything
+	static uint64_t next_id()
+	{
+		static std::atomic<uint64_t> next{ 0 };
+		return next.fetch_add(1, std::memory_order_relaxed) + 1;
+	}
 };
 
 chip8::chip8()
@@ -106,7 +431,29 @@ chip8::chip8()
 		_memory[FONTSET_START_ADDRESS + i] = fontset[i];
 	}
 
-	// Set up function pointer table
+	set_speed(DEFAULT_INSTRUCTIONS_PER_SECOND);
+
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_PREDECODE
+	for (Decoded& slot : _decoded) {
+		slot = make_decoded(0);
+		slot.id = ID_UNDECODED;
+	}
+#endif
+}
+
+// Undefined opcodes fall through to OP_NULL
+template <size_t Size>
+constexpr std::array<chip8::Chip8Func, Size> chip8::make_null_table()
+{
+	std::array<Chip8Func, Size> table{};
+	for (size_t i = 0; i < Size; ++i)
+		table[i] = &chip8::OP_NULL;
+	return table;
+}
+
+constexpr std::array<chip8::Chip8Func, 0xF + 1> chip8::make_table()
+{
+	std::array<Chip8Func, 0xF + 1> table = make_null_table<0xF + 1>();
 	table[0x0] = &chip8::Table0;
 	table[0x1] = &chip8::OP_1nnn;
 	table[0x2] = &chip8::OP_2nnn;
@@ -123,10 +470,20 @@ chip8::chip8()
 	table[0xD] = &chip8::OP_Dxyn;
 	table[0xE] = &chip8::TableE;
 	table[0xF] = &chip8::TableF;
+	return table;
+}
 
+constexpr std::array<chip8::Chip8Func, 0xF + 1> chip8::make_table0()
+{
+	std::array<Chip8Func, 0xF + 1> table0 = make_null_table<0xF + 1>();
 	table0[0x0] = &chip8::OP_00E0;
 	table0[0xE] = &chip8::OP_00EE;
+	return table0;
+}
 
+constexpr std::array<chip8::Chip8Func, 0xF + 1> chip8::make_table8()
+{
+	std::array<Chip8Func, 0xF + 1> table8 = make_null_table<0xF + 1>();
 	table8[0x0] = &chip8::OP_8xy0;
 	table8[0x1] = &chip8::OP_8xy1;
 	table8[0x2] = &chip8::OP_8xy2;
@@ -136,10 +493,20 @@ chip8::chip8()
 	table8[0x6] = &chip8::OP_8xy6;
 	table8[0x7] = &chip8::OP_8xy7;
 	table8[0xE] = &chip8::OP_8xyE;
+	return table8;
+}
 
+constexpr std::array<chip8::Chip8Func, 0xF + 1> chip8::make_tableE()
+{
+	std::array<Chip8Func, 0xF + 1> tableE = make_null_table<0xF + 1>();
 	tableE[0x1] = &chip8::OP_ExA1;
 	tableE[0xE] = &chip8::OP_Ex9E;
+	return tableE;
+}
 
+constexpr std::array<chip8::Chip8Func, 0xFF + 1> chip8::make_tableF()
+{
+	std::array<Chip8Func, 0xFF + 1> tableF = make_null_table<0xFF + 1>();
 	tableF[0x07] = &chip8::OP_Fx07;
 	tableF[0x0A] = &chip8::OP_Fx0A;
 	tableF[0x15] = &chip8::OP_Fx15;
@@ -149,26 +516,30 @@ chip8::chip8()
 	tableF[0x33] = &chip8::OP_Fx33;
 	tableF[0x55] = &chip8::OP_Fx55;
 	tableF[0x65] = &chip8::OP_Fx65;
+	return tableF;
 }
 
 void chip8::Table0()
 {
+	static constexpr std::array<Chip8Func, 0xF + 1> table0 = make_table0();
 	((*this).*(table0[_opcode & 0x000Fu]))();
 }
 
 void chip8::Table8()
 {
-	if((_opcode & 0x000F) != 0xE)
-		((*this).*(table8[_opcode & 0x000Fu]))();
+	static constexpr std::array<Chip8Func, 0xF + 1> table8 = make_table8();
+	((*this).*(table8[_opcode & 0x000Fu]))();
 }
 
 void chip8::TableE()
 {
+	static constexpr std::array<Chip8Func, 0xF + 1> tableE = make_tableE();
 	((*this).*(tableE[_opcode & 0x000Fu]))();
 }
 
 void chip8::TableF()
 {
+	static constexpr std::array<Chip8Func, 0xFF + 1> tableF = make_tableF();
 	((*this).*(tableF[_opcode & 0x00FFu]))();
 }
 
@@ -184,67 +555,813 @@ void chip8::load_rom(const char* filename)
 		file.read(buffer, size);
 		file.close();
 
-		for (long i = 0; i < size; ++i) {
-			_memory[START_ADDRESS + i] = static_cast<uint8_t>(buffer[i]);
-		}
+		load_rom(reinterpret_cast<const uint8_t*>(buffer), static_cast<size_t>(size));
 		delete[] buffer;
 	}
 }
 
-void chip8::cycle()
+void chip8::load_rom(const uint8_t* data, size_t size)
+{
+	if (size > sizeof(_memory) - START_ADDRESS)
+		size = sizeof(_memory) - START_ADDRESS;
+
+	for (size_t i = 0; i < size; ++i) {
+		_memory[START_ADDRESS + i] = data[i];
+	}
+
+	memory_written(START_ADDRESS, size);
+}
+
+chip8::State chip8::fork()
+{
+	return fork(State());
+}
+
+chip8::State chip8::fork(const State& parent)
+{
+	State state;
+	state._id = State::next_id();
+	std::copy(std::begin(_display), std::end(_display), state._display);
+	std::copy(std::begin(_stack), std::end(_stack), state._stack);
+	std::copy(std::begin(_register), std::end(_register), state._register);
+	std::copy(std::begin(_keypad), std::end(_keypad), state._keypad);
+	state._time = _time;
+	state._next_tick = _next_tick;
+	state._random = _random;
+	state._pc = _pc;
+	state._index = _index;
+	state._sp = _sp;
+	state._delay_timer = _delay_timer;
+	state._sound_timer = _sound_timer;
+	state._events = _events;
+	state._halt_register = _halt_register;
+	state._halted = _halted;
+
+	// Clean pages are known to match the parent's without looking. Otherwise
+	// compare, a page written back with the same bytes can still be shared.
+	bool based = parent._id != 0 && parent._id == _base_state;
+	for (unsigned int page = 0; page < State::PAGE_COUNT; ++page) {
+		const uint8_t* bytes = &_memory[page * State::PAGE_SIZE];
+		const std::shared_ptr<const State::Page>& shared = parent._pages[page];
+
+		if (shared && ((based && !(_dirty_pages & (1u << page))) || memcmp(shared->bytes, bytes, State::PAGE_SIZE) == 0)) {
+			state._pages[page] = shared;
+		}
+		else {
+			std::shared_ptr<State::Page> copy = std::make_shared<State::Page>();
+			memcpy(copy->bytes, bytes, State::PAGE_SIZE);
+			state._pages[page] = std::move(copy);
+		}
+	}
+
+	_base_state = state._id;
+	_dirty_pages = 0;
+	return state;
+}
+
+void chip8::restore(const State& state)
+{
+	for (unsigned int y = 0; y < 32; ++y) {
+		if (_display[y] != state._display[y])
+			_dirty_rows |= 1u << y;
+	}
+	std::copy(std::begin(state._display), std::end(state._display), _display);
+	std::copy(std::begin(state._stack), std::end(state._stack), _stack);
+	std::copy(std::begin(state._register), std::end(state._register), _register);
+	std::copy(std::begin(state._keypad), std::end(state._keypad), _keypad);
+	_time = state._time;
+	_next_tick = state._next_tick;
+	_random = state._random;
+	_pc = state._pc;
+	_index = state._index;
+	_sp = state._sp;
+	_delay_timer = state._delay_timer;
+	_sound_timer = state._sound_timer;
+	_events = state._events;
+	_halt_register = state._halt_register;
+	_halted = state._halted;
+
+	// Only pages that really change are reported, so translated code elsewhere survives
+	bool based = state._id != 0 && state._id == _base_state;
+	uint16_t unknown = 0;
+	for (unsigned int page = 0; page < State::PAGE_COUNT; ++page) {
+		if (!state._pages[page]) {
+			unknown |= 1u << page;
+			continue;
+		}
+		if (based && !(_dirty_pages & (1u << page)))
+			continue;
+
+		uint8_t* bytes = &_memory[page * State::PAGE_SIZE];
+		if (memcmp(bytes, state._pages[page]->bytes, State::PAGE_SIZE) != 0) {
+			memcpy(bytes, state._pages[page]->bytes, State::PAGE_SIZE);
+			memory_written(static_cast<uint16_t>(page * State::PAGE_SIZE), State::PAGE_SIZE);
+		}
+	}
+
+	_base_state = state._id;
+	_dirty_pages = unknown;
+}
+
+// Mirrors the lookups done by table/Table0/Table8/TableE/TableF so every
+// backend agrees on what a given opcode does.
+constexpr uint8_t chip8::decode(uint16_t opcode)
 {
-	// Fetch
-	_opcode = (_memory[_pc] << 8) | _memory[_pc + 1];
+	switch (opcode >> 12) {
+	case 0x0:
+		switch (opcode & 0x000Fu) {
+		case 0x0: return ID_00E0;
+		case 0xE: return ID_00EE;
+		}
+		break;
+	case 0x1: return ID_1nnn;
+	case 0x2: return ID_2nnn;
+	case 0x3: return ID_3xkk;
+	case 0x4: return ID_4xkk;
+	case 0x5: return ID_5xy0;
+	case 0x6: return ID_6xkk;
+	case 0x7: return ID_7xkk;
+	case 0x8:
+		switch (opcode & 0x000Fu) {
+		case 0x0: return ID_8xy0;
+		case 0x1: return ID_8xy1;
+		case 0x2: return ID_8xy2;
+		case 0x3: return ID_8xy3;
+		case 0x4: return ID_8xy4;
+		case 0x5: return ID_8xy5;
+		case 0x6: return ID_8xy6;
+		case 0x7: return ID_8xy7;
+		case 0xE: return ID_8xyE;
+		}
+		break;
+	case 0x9: return ID_9xy0;
+	case 0xA: return ID_Annn;
+	case 0xB: return ID_Bnnn;
+	case 0xC: return ID_Cxkk;
+	case 0xD: return ID_Dxyn;
+	case 0xE:
+		switch (opcode & 0x000Fu) {
+		case 0x1: return ID_ExA1;
+		case 0xE: return ID_Ex9E;
+		}
+		break;
+	case 0xF:
+		switch (opcode & 0x00FFu) {
+		case 0x07: return ID_Fx07;
+		case 0x0A: return ID_Fx0A;
+		case 0x15: return ID_Fx15;
+		case 0x18: return ID_Fx18;
+		case 0x1E: return ID_Fx1E;
+		case 0x29: return ID_Fx29;
+		case 0x33: return ID_Fx33;
+		case 0x55: return ID_Fx55;
+		case 0x65: return ID_Fx65;
+		}
+		break;
+	}
+	return ID_NULL;
+}
+
+constexpr std::array<uint8_t, 0x10000> chip8::make_id_table()
+{
+	std::array<uint8_t, 0x10000> ids{};
+	for (uint32_t opcode = 0; opcode < 0x10000; ++opcode)
+		ids[opcode] = decode(static_cast<uint16_t>(opcode));
+	return ids;
+}
+
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_DECODE64K
+constexpr std::array<chip8::Handler, 0x10000> chip8::make_decode_table()
+{
+#define CHIP8_THUNK(name) &thunk<&chip8::OP_##name>,
+	constexpr Handler handlers[ID_COUNT] = { &thunk<&chip8::OP_NULL>, CHIP8_INSTRUCTIONS(CHIP8_THUNK) };
+#undef CHIP8_THUNK
+
+	std::array<Handler, 0x10000> decoded{};
+	for (uint32_t opcode = 0; opcode < 0x10000; ++opcode)
+		decoded[opcode] = handlers[decode(static_cast<uint16_t>(opcode))];
+	return decoded;
+}
+#endif
+
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_MUSTTAIL
+uint64_t chip8::tail_next(chip8& c, uint64_t count)
+{
+	static constexpr std::array<uint8_t, 0x10000> ids = make_id_table();
+#define CHIP8_TAIL_OP(name) &tail_op<&chip8::OP_##name, ID_##name>,
+	static constexpr TailFunc handlers[ID_COUNT] = { &tail_op<&chip8::OP_NULL, ID_NULL>, CHIP8_INSTRUCTIONS(CHIP8_TAIL_OP) };
+#undef CHIP8_TAIL_OP
+
+	if (count == 0 || (c._events & c._stop_on))
+		return count;
+
+	c._opcode = c.fetch();
+	c._pc += 2;
+	CHIP8_MUSTTAIL return handlers[ids[c._opcode]](c, count - 1);
+}
+
+template <void (chip8::* F)(), uint8_t Id>
+uint64_t chip8::tail_op(chip8& c, uint64_t count)
+{
+	(c.*F)();
+	c.retire(Id);
+#ifdef CHIP8_HAS_MUSTTAIL
+	CHIP8_MUSTTAIL return tail_next(c, count);
+#else
+	return count;
+#endif
+}
+#endif
 
-	// Increment the PC before we execute anything
-	_pc += 2;
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_PREDECODE
+void chip8::predecode(uint16_t address)
+{
+	_decoded[address] = make_decoded(opcode_at(address));
+
+	_decoded_bitmap[address / 64] |= 1ull << (address % 64);
+}
+
+// Decodes the slot at address and tags it with the idiom it starts, if any.
+// The instructions after it get plain slots so fused handlers can read their operands.
+void chip8::predecode_fused(uint16_t address)
+{
+	predecode(address);
+
+	Decoded& slot = _decoded[address];
+	uint16_t next = opcode_at(address + 2);
+	uint8_t fused = FUSED_NONE;
+
+	switch (slot.id) {
+	case ID_Annn:
+		if (decode(next) == ID_Dxyn)
+			fused = FUSED_ANNN_DXYN;
+		break;
+	case ID_6xkk:
+		if (decode(next) == ID_6xkk)
+			fused = FUSED_6XKK_6YKK;
+		break;
+	case ID_3xkk:
+	case ID_4xkk:
+		if (decode(next) == ID_1nnn)
+			fused = FUSED_SKIP_1NNN;
+		break;
+	case ID_Fx07:
+		if (next == (0x3000u | (slot.x << 8)) && decode(opcode_at(address + 4)) == ID_1nnn)
+			fused = FUSED_TIMER_POLL;
+		break;
+	}
+
+	if (fused == FUSED_NONE)
+		return;
+
+	slot.fused = fused;
+	for (unsigned int offset = 2; offset <= (fused == FUSED_TIMER_POLL ? 4u : 2u); offset += 2) {
+		uint16_t follower = (address + offset) & 0xFFFu;
+		if (_decoded[follower].id == ID_UNDECODED)
+			predecode(follower);
+	}
+}
+
+void chip8::invalidate(uint16_t address, size_t length)
+{
+	// The instruction starting one byte earlier also covers the first byte,
+	// including the slot at 0xFFF whose second byte wraps to 0x000. Fused
+	// slots also depend on the instructions after them.
+	for (size_t k = 0; k < length + 1 + FUSION_REACH && k < 4096; ++k) {
+		size_t i = (address + 4095u - FUSION_REACH + k) & 0xFFFu;
+		uint64_t bit = 1ull << (i % 64);
+		if (_decoded_bitmap[i / 64] & bit) {
+			_decoded_bitmap[i / 64] &= ~bit;
+			_decoded[i].id = ID_UNDECODED;
+		}
+	}
+}
+#endif
+
+void chip8::memory_written(uint16_t address, size_t length)
+{
+	// Addresses wrap at 4 KB, report the wrapped part separately
+	address &= 0xFFFu;
+	if (address + length > 4096) {
+		memory_written(0, address + length - 4096);
+		length = 4096 - address;
+	}
+
+	for (size_t page = address / State::PAGE_SIZE; length > 0 && page <= (address + length - 1) / State::PAGE_SIZE; ++page)
+		_dirty_pages |= 1u << page;
+
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_PREDECODE
+	invalidate(address, length);
+#endif
+
+	if (_write_hook)
+		_write_hook(_write_hook_user, address, length);
+}
+
+void chip8::execute_opcode(uint16_t opcode)
+{
+	// Runs a single instruction outside the dispatch loop, the PC must already point past it
+	_opcode = opcode;
+
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_PREDECODE
+	const Decoded insn = make_decoded(opcode);
+	_insn = &insn;
+#endif
+
+	switch (decode(opcode)) {
+#define CHIP8_CASE(name) case ID_##name: OP_##name(); break;
+	CHIP8_INSTRUCTIONS(CHIP8_CASE)
+#undef CHIP8_CASE
+	default: break;
+	}
+}
 
-	// Decode and Execute
-	((*this).*(table[(_opcode & 0xF000u) >> 12]))();
+void chip8::tick_timers()
+{
+	// Every 60 Hz boundary the clock has passed, usually just the one
+	uint64_t ticks = (_time - _next_tick) / _tick_period + 1;
+	_next_tick += ticks * _tick_period;
+	_events |= EVENT_TIMER;
 
 	// Decrement the delay timer if it's been set
-	if (_delay_timer > 0)
-		--_delay_timer;
+	_delay_timer = static_cast<uint8_t>(_delay_timer > ticks ? _delay_timer - ticks : 0);
 
 	// Decrement the sound timer if it's been set
-	if (_sound_timer > 0)
-		--_sound_timer;
+	if (_sound_timer > 0) {
+		if (_sound_timer <= ticks) {
+			_sound_timer = 0;
+			_events |= EVENT_SOUND;
+		}
+		else {
+			_sound_timer = static_cast<uint8_t>(_sound_timer - ticks);
+		}
+	}
+}
+
+// Clock time of the first timer tick that raises an event in stop_on
+uint64_t chip8::stop_time(uint8_t stop_on) const
+{
+	if (stop_on & EVENT_TIMER)
+		return _next_tick;
+	if ((stop_on & EVENT_SOUND) && _sound_timer > 0)
+		return _next_tick + (_sound_timer - 1u) * _tick_period;
+	return UINT64_MAX;
+}
+
+void chip8::set_speed(uint32_t instructions_per_second)
+{
+	// A tick every instructions_per_second / 60 instructions, without rounding
+	std::fill(std::begin(_costs), std::end(_costs), TIMER_FREQUENCY);
+	_tick_period = std::max<uint32_t>(instructions_per_second, 1);
+	_time = 0;
+	_next_tick = _tick_period;
+}
+
+void chip8::set_vip_timing()
+{
+	// Microseconds scaled so a 60 Hz period is a whole number of units
+	for (uint8_t id = 0; id < ID_COUNT; ++id)
+		_costs[id] = vip_microseconds(id) * TIMER_FREQUENCY;
+	_tick_period = 1000000;
+	_time = 0;
+	_next_tick = _tick_period;
+}
+
+// Typical execution time of each instruction in the original COSMAC VIP
+// interpreter. Draws, BCD and register transfers really depend on their
+// operands, these are averages.
+constexpr uint32_t chip8::vip_microseconds(uint8_t id)
+{
+	switch (id) {
+	case ID_00E0: return 109;
+	case ID_00EE: return 105;
+	case ID_1nnn: return 105;
+	case ID_2nnn: return 105;
+	case ID_3xkk: return 55;
+	case ID_4xkk: return 55;
+	case ID_5xy0: return 73;
+	case ID_6xkk: return 27;
+	case ID_7xkk: return 45;
+	case ID_8xy0: case ID_8xy1: case ID_8xy2: case ID_8xy3: case ID_8xy4:
+	case ID_8xy5: case ID_8xy6: case ID_8xy7: case ID_8xyE: return 200;
+	case ID_9xy0: return 73;
+	case ID_Annn: return 55;
+	case ID_Bnnn: return 105;
+	case ID_Cxkk: return 164;
+	case ID_Dxyn: return 22734;
+	case ID_Ex9E: return 73;
+	case ID_ExA1: return 73;
+	case ID_Fx07: return 45;
+	case ID_Fx0A: return 45;
+	case ID_Fx15: return 45;
+	case ID_Fx18: return 45;
+	case ID_Fx1E: return 86;
+	case ID_Fx29: return 91;
+	case ID_Fx33: return 927;
+	case ID_Fx55: return 605;
+	case ID_Fx65: return 605;
+	}
+	return 27;
+}
+
+// Returns the number of instructions left unexecuted
+uint64_t chip8::execute(uint64_t count, uint8_t stop_on)
+{
+	if (_halted)
+		count = wait_for_key(count, stop_on);
+
+	// Spin loops leave the dispatch loop to be skipped ahead, then dispatch resumes
+	while (count > 0 && !_halted) {
+		count = dispatch(count, stop_on | EVENT_KEY_WAIT | EVENT_IDLE);
+
+		bool idle = _events & EVENT_IDLE;
+		_events &= ~EVENT_IDLE;
+		if (!idle || (_events & stop_on))
+			break;
+
+		count = skip_idle(count, stop_on);
+		if (_events & stop_on)
+			break;
+	}
+
+	// Halting always leaves the dispatch loop, the rest of the budget only ticks the timers
+	if (_halted && count > 0 && !(_events & stop_on))
+		count = wait_for_key(count, stop_on);
+	return count;
+}
+
+// Runs instructions until the budget is spent or an event in stop_on is raised
+uint64_t chip8::dispatch(uint64_t count, uint8_t stop_on)
+{
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_GOTO
+	static constexpr std::array<uint8_t, 0x10000> ids = make_id_table();
+#define CHIP8_LABEL(name) &&L_##name,
+	static const void* const labels[ID_COUNT] = { &&L_NULL, CHIP8_INSTRUCTIONS(CHIP8_LABEL) };
+#undef CHIP8_LABEL
+
+#define CHIP8_NEXT()                                        \
+	if (count == 0 || (_events & stop_on))                  \
+		return count;                                       \
+	--count;                                                \
+	_opcode = fetch();                                      \
+	_pc += 2;                                               \
+	goto *labels[ids[_opcode]]
+
+	CHIP8_NEXT();
+
+L_NULL:
+	retire(ID_NULL);
+	CHIP8_NEXT();
+
+#define CHIP8_CASE(name) L_##name: OP_##name(); retire(ID_##name); CHIP8_NEXT();
+	CHIP8_INSTRUCTIONS(CHIP8_CASE)
+#undef CHIP8_CASE
+#undef CHIP8_NEXT
+
+#elif CHIP8_DISPATCH == CHIP8_DISPATCH_MUSTTAIL
+	_stop_on = stop_on;
+#ifdef CHIP8_HAS_MUSTTAIL
+	return tail_next(*this, count);
+#else
+	// Each handler returns here after one instruction
+	while (count != 0 && !(_events & stop_on))
+		count = tail_next(*this, count);
+	return count;
+#endif
+
+#elif CHIP8_DISPATCH == CHIP8_DISPATCH_PREDECODE
+	while (count > 0) {
+		--count;
+		uint16_t address = _pc & 0xFFFu;
+
+		// Only the first visit, or the first after a write, pays for decode
+		if (_decoded[address].id == ID_UNDECODED)
+			predecode_fused(address);
+
+		_insn = &_decoded[address];
+		_pc += 2;
+
+		if (_insn->fused != FUSED_NONE && _fusion) {
+			count = execute_fused(address, count, stop_on);
+			if (_events & stop_on)
+				break;
+			continue;
+		}
+
+		// The handler may invalidate its own slot
+		uint8_t id = _insn->id;
+		switch (id) {
+#define CHIP8_CASE(name) case ID_##name: OP_##name(); break;
+		CHIP8_INSTRUCTIONS(CHIP8_CASE)
+#undef CHIP8_CASE
+		default: break;
+		}
+
+		retire(id);
+		if (_events & stop_on)
+			break;
+	}
+	return count;
+
+#else
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_TABLE || CHIP8_DISPATCH == CHIP8_DISPATCH_DECODE64K
+	// Only needed to charge the instruction's cost
+	static constexpr std::array<uint8_t, 0x10000> ids = make_id_table();
+#endif
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_TABLE
+	static constexpr std::array<Chip8Func, 0xF + 1> table = make_table();
+#elif CHIP8_DISPATCH == CHIP8_DISPATCH_DECODE64K
+	static constexpr std::array<Handler, 0x10000> handlers = make_decode_table();
+#endif
+
+	while (count > 0) {
+		--count;
+
+		// Fetch
+		_opcode = fetch();
+
+		// Increment the PC before we execute anything
+		_pc += 2;
+
+		// Decode and Execute
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_TABLE
+		uint8_t id = ids[_opcode];
+		((*this).*(table[(_opcode & 0xF000u) >> 12]))();
+#elif CHIP8_DISPATCH == CHIP8_DISPATCH_SWITCH
+		uint8_t id = decode(_opcode);
+		switch (id) {
+#define CHIP8_CASE(name) case ID_##name: OP_##name(); break;
+		CHIP8_INSTRUCTIONS(CHIP8_CASE)
+#undef CHIP8_CASE
+		default: break;
+		}
+#elif CHIP8_DISPATCH == CHIP8_DISPATCH_DECODE64K
+		uint8_t id = ids[_opcode];
+		handlers[_opcode](*this);
+#endif
+
+		retire(id);
+		if (_events & stop_on)
+			break;
+	}
+	return count;
+#endif
+}
+
+#if CHIP8_DISPATCH == CHIP8_DISPATCH_PREDECODE
+// Runs the idiom starting at address. Every instruction still counts against
+// the budget and ticks the timers, and the sequence stops wherever the
+// dispatch loop would have, so the result matches unfused execution exactly.
+uint64_t chip8::execute_fused(uint16_t address, uint64_t count, uint8_t stop_on)
+{
+	const Decoded& first = *_insn;
+	const Decoded& second = _decoded[(address + 2) & 0xFFFu];
+
+	switch (first.fused) {
+	case FUSED_ANNN_DXYN:
+		_index = first.nnn;
+		if (!fused_step(ID_Annn, count, stop_on))
+			break;
+		_insn = &second;
+		_pc += 2;
+		OP_Dxyn();
+		fused_retire(ID_Dxyn);
+		break;
+
+	case FUSED_6XKK_6YKK:
+		_register[first.x] = first.kk;
+		if (!fused_step(ID_6xkk, count, stop_on))
+			break;
+		_register[second.x] = second.kk;
+		_pc += 2;
+		fused_retire(ID_6xkk);
+		break;
+
+	case FUSED_SKIP_1NNN:
+		if ((_register[first.x] == first.kk) == (first.id == ID_3xkk)) {
+			_pc += 2;
+			fused_retire(first.id);
+			break;
+		}
+		if (!fused_step(first.id, count, stop_on))
+			break;
+		if (idle_loop(second.nnn, (address + 2) & 0xFFFu))
+			_events |= EVENT_IDLE;
+		_pc = second.nnn;
+		fused_retire(ID_1nnn);
+		break;
+
+	case FUSED_TIMER_POLL:
+		_register[first.x] = _delay_timer;
+		if (!fused_step(ID_Fx07, count, stop_on))
+			break;
+		_pc += 2;
+		if (_register[first.x] == 0) {
+			_pc += 2;
+			fused_retire(ID_3xkk);
+			break;
+		}
+		if (!fused_step(ID_3xkk, count, stop_on))
+			break;
+		_pc = _decoded[(address + 4) & 0xFFFu].nnn;
+		if (idle_loop(_pc, (address + 4) & 0xFFFu))
+			_events |= EVENT_IDLE;
+		fused_retire(ID_1nnn);
+		break;
+	}
+	return count;
+}
+
+// Finishes one instruction of a fused idiom and takes the budget for the
+// next, returning false if the dispatch loop would have stopped instead
+bool chip8::fused_step(uint8_t id, uint64_t& count, uint8_t stop_on)
+{
+	fused_retire(id);
+
+	if (count == 0 || (_events & stop_on))
+		return false;
+
+	--count;
+	return true;
+}
+#endif
+
+void chip8::cycle()
+{
+	_events = EVENT_NONE;
+	_instructions += 1 - execute(1, EVENT_NONE);
+}
+
+uint64_t chip8::run(uint64_t cycles, uint8_t stop_on)
+{
+	_events = EVENT_NONE;
+	uint64_t executed = cycles - execute(cycles, stop_on);
+	_instructions += executed;
+	return executed;
+}
+
+uint64_t chip8::run_until_frame()
+{
+	// Time always advances, even while parked, so this can't run forever
+	return run(UINT64_MAX, EVENT_TIMER);
+}
+
+void chip8::press_key(uint8_t key)
+{
+	key &= 0xFu;
+	_keypad[key] = 1;
+
+	if (_halted) {
+		_register[_halt_register] = key;
+		_halted = false;
+	}
+}
+
+// Completes a pending Fx0A with the lowest key held, for embedders that write _keypad directly
+bool chip8::resume()
+{
+	for (uint8_t key = 0; key < 16; ++key) {
+		if (_keypad[key]) {
+			_register[_halt_register] = key;
+			_halted = false;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Spends the budget on timer ticks alone while parked, as if Fx0A kept
+// re-running, returning what is left if a key is already held or a tick
+// raises an event in stop_on
+uint64_t chip8::wait_for_key(uint64_t count, uint8_t stop_on)
+{
+	if (resume())
+		return count;
+
+	return idle(count, _costs[ID_Fx0A], stop_on);
+}
+
+// Advances the clock over count instructions of the given cost that change
+// nothing else, stopping after the one that reaches a tick in stop_on
+uint64_t chip8::idle(uint64_t count, uint32_t cost, uint8_t stop_on)
+{
+	// Keep the clock far from overflowing when nothing would ever stop it
+	uint64_t n = std::min<uint64_t>(count, (UINT64_MAX / 2u - _time) / cost);
+
+	uint64_t stop = stop_time(stop_on);
+	if (stop != UINT64_MAX)
+		n = std::min<uint64_t>(n, (stop - _time + cost - 1u) / cost);
+
+	_time += n * cost;
+	if (_time >= _next_tick)
+		tick_timers();
+	return count - n;
+}
+
+// True if the jump from `from` to `target` closes a loop that only waits on
+// the timers: 1nnn to itself, or Fx07, 3x00, 1nnn polling the delay timer
+bool chip8::idle_loop(uint16_t target, uint16_t from) const
+{
+	if (target == from)
+		return true;
+
+	if (((target + 4) & 0xFFFu) != from)
+		return false;
+
+	uint16_t poll = opcode_at(target);
+	return (poll & 0xF0FFu) == 0xF007u && opcode_at(target + 2) == (0x3000u | (poll & 0x0F00u));
+}
+
+// Runs whole iterations of the spin loop at the PC at once, as many as fit in
+// the budget without reaching an exit or a stop. What is left is dispatched normally.
+uint64_t chip8::skip_idle(uint64_t count, uint8_t stop_on)
+{
+	uint16_t poll = opcode_at(_pc);
+
+	if (poll == (0x1000u | (_pc & 0xFFFu)))
+		return idle(count, _costs[ID_1nnn], stop_on);
+
+	// Each iteration reads the delay timer first and exits once that reads
+	// zero, which happens at the tick that brings it down from its current value
+	uint64_t cost = _costs[ID_Fx07] + _costs[ID_3xkk] + _costs[ID_1nnn];
+	uint64_t iterations = 0;
+	if (_delay_timer > 0) {
+		uint64_t zero = _next_tick + (_delay_timer - 1u) * _tick_period;
+		iterations = (zero - _time + cost - 1u) / cost;
+	}
+	iterations = std::min<uint64_t>(iterations, count / 3u);
+
+	// Stop short of the iteration that reaches a tick in stop_on, dispatch takes it from there
+	uint64_t stop = stop_time(stop_on);
+	if (stop != UINT64_MAX)
+		iterations = std::min<uint64_t>(iterations, (stop - _time - 1u) / cost);
+
+	if (iterations == 0)
+		return count;
+
+	// Vx keeps what the last skipped iteration read
+	_time += (iterations - 1u) * cost;
+	if (_time >= _next_tick)
+		tick_timers();
+	_register[(poll & 0x0F00u) >> 8] = _delay_timer;
+
+	_time += cost;
+	if (_time >= _next_tick)
+		tick_timers();
+	return count - 3u * iterations;
+}
+
+void chip8::render(uint32_t* out, uint32_t on, uint32_t off) const
+{
+	for (unsigned int y = 0; y < 32; ++y) {
+		uint64_t line = _display[y];
+		uint32_t* pixels = &out[(31 - y) * 64];
+
+		for (unsigned int x = 0; x < 64; ++x)
+			pixels[x] = (line >> (63 - x)) & 1u ? on : off;
+	}
 }
 
 void chip8::OP_00E0()
 {
 	// Clear the display.
-	memset(_video, 0x000000FF, sizeof(_video));
+	memset(_display, 0, sizeof(_display));
+	_dirty_rows = 0xFFFFFFFF;
+	_events |= EVENT_DRAW;
 }
 
 void chip8::OP_00EE()
 {
 	// Return from a subroutine.
-	_sp = _sp - 1;
+	_sp = (_sp - 1) & 0xFu;
 	_pc = _stack[_sp];
 }
 
 void chip8::OP_1nnn()
 {
 	// Jump to location nnn.
-	uint16_t address = _opcode & 0x0FFFu;
+	uint16_t address = op_nnn();
+
+	if (idle_loop(address, (_pc - 2) & 0xFFFu))
+		_events |= EVENT_IDLE;
+
 	_pc = address;
 }
 
 void chip8::OP_2nnn()
 {
 	// Call subroutine at nnn.
-	uint16_t address = _opcode & 0x0FFFu;
+	uint16_t address = op_nnn();
 	_stack[_sp] = _pc;
-	_sp = _sp + 1;
+	_sp = (_sp + 1) & 0xFu;
 	_pc = address;
 }
 
 void chip8::OP_3xkk()
 {
 	// Skip next instruction if Vx = kk.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8u;
-	uint8_t byte = _opcode & 0x00FFu;
+	uint8_t Vx = op_x();
+	uint8_t byte = op_kk();
 
 	if (_register[Vx] == byte)
 		_pc += 2;
@@ -253,8 +1370,8 @@ void chip8::OP_3xkk()
 void chip8::OP_4xkk()
 {
 	// Skip next instruction if Vx != kk.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
-	uint8_t byte = _opcode & 0x00FFu;
+	uint8_t Vx = op_x();
+	uint8_t byte = op_kk();
 
 	if (_register[Vx] != byte)
 		_pc += 2;
@@ -263,8 +1380,8 @@ void chip8::OP_4xkk()
 void chip8::OP_5xy0()
 {
 	// Skip next instruction if Vx = Vy.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
-	uint8_t Vy = (_opcode & 0x00F0u) >> 4;
+	uint8_t Vx = op_x();
+	uint8_t Vy = op_y();
 
 	if (_register[Vx] == _register[Vy])
 		_pc += 2;
@@ -273,56 +1390,56 @@ void chip8::OP_5xy0()
 void chip8::OP_6xkk()
 {
 	// Set Vx = kk.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
-	uint8_t byte = _opcode & 0x00FFu;
+	uint8_t Vx = op_x();
+	uint8_t byte = op_kk();
 	_register[Vx] = byte;
 }
 
 void chip8::OP_7xkk()
 {
 	// Set Vx = Vx + kk.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
-	uint8_t byte = _opcode & 0x00FFu;
+	uint8_t Vx = op_x();
+	uint8_t byte = op_kk();
 	_register[Vx] += byte;
 }
 
 void chip8::OP_8xy0()
 {
 	// Set Vx = Vy.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
-	uint8_t Vy = (_opcode & 0x00F0u) >> 4;
+	uint8_t Vx = op_x();
+	uint8_t Vy = op_y();
 	_register[Vx] = _register[Vy];
 }
 
 void chip8::OP_8xy1()
 {
 	// Set Vx = Vx OR Vy.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
-	uint8_t Vy = (_opcode & 0x00F0u) >> 4;
+	uint8_t Vx = op_x();
+	uint8_t Vy = op_y();
 	_register[Vx] |= _register[Vy];
 }
 
 void chip8::OP_8xy2()
 {
 	// Set Vx = Vx AND Vy.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
-	uint8_t Vy = (_opcode & 0x00F0u) >> 4;
+	uint8_t Vx = op_x();
+	uint8_t Vy = op_y();
 	_register[Vx] &= _register[Vy];
 }
 
 void chip8::OP_8xy3()
 {
 	// Set Vx = Vx XOR Vy.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
-	uint8_t Vy = (_opcode & 0x00F0u) >> 4;
+	uint8_t Vx = op_x();
+	uint8_t Vy = op_y();
 	_register[Vx] ^= _register[Vy];
 }
 
 void chip8::OP_8xy4()
 {
 	// Set Vx = Vx + Vy, set VF = carry.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
-	uint8_t Vy = (_opcode & 0x00F0u) >> 4;
+	uint8_t Vx = op_x();
+	uint8_t Vy = op_y();
 	uint16_t sum = _register[Vx] + _register[Vy];
 
 	if (sum > 255u)
@@ -335,8 +1452,8 @@ void chip8::OP_8xy4()
 void chip8::OP_8xy5()
 {
 	// Set Vx = Vx - Vy, set VF = NOT borrow.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
-	uint8_t Vy = (_opcode & 0x00F0u) >> 4;
+	uint8_t Vx = op_x();
+	uint8_t Vy = op_y();
 
 	if (_register[Vx] > _register[Vy])
 		_register[0xF] = 1;
@@ -348,7 +1465,7 @@ void chip8::OP_8xy5()
 void chip8::OP_8xy6()
 {
 	// Set Vx = Vx SHR 1.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
+	uint8_t Vx = op_x();
 	_register[0xF] = (_register[Vx] & 0x1u);
 	_register[Vx] >>= 1;
 }
@@ -356,8 +1473,8 @@ void chip8::OP_8xy6()
 void chip8::OP_8xy7()
 {
 	// Set Vx = Vy - Vx, set VF = NOT borrow.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
-	uint8_t Vy = (_opcode & 0x00F0u) >> 4;
+	uint8_t Vx = op_x();
+	uint8_t Vy = op_y();
 
 	if (_register[Vy] > _register[Vx])
 		_register[0xF] = 1;
@@ -369,7 +1486,7 @@ void chip8::OP_8xy7()
 void chip8::OP_8xyE()
 {
 	// Set Vx = Vx SHL 1.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
+	uint8_t Vx = op_x();
 	_register[0xF] = (_register[Vx] & 0x80u) >> 7;
 	_register[Vx] <<= 1;
 }
@@ -377,8 +1494,8 @@ void chip8::OP_8xyE()
 void chip8::OP_9xy0()
 {
 	// Skip next instruction if Vx != Vy.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
-	uint8_t Vy = (_opcode & 0x00F0u) >> 4;
+	uint8_t Vx = op_x();
+	uint8_t Vy = op_y();
 
 	if (_register[Vx] != _register[Vy])
 		_pc += 2;
@@ -387,59 +1504,65 @@ void chip8::OP_9xy0()
 void chip8::OP_Annn()
 {
 	// Set I = nnn.
-	uint16_t address = _opcode & 0x0FFFu;
+	uint16_t address = op_nnn();
 	_index = address;
 }
 
 void chip8::OP_Bnnn()
 {
 	// Jump to location nnn + V0.
-	uint16_t address = _opcode & 0x0FFFu;
+	uint16_t address = op_nnn();
 	_pc = _register[0] + address;
 }
 
 void chip8::OP_Cxkk()
 {
 	// Set Vx = random byte AND kk.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
-	uint8_t byte = _opcode & 0x00FFu;
-	_register[Vx] = static_cast<uint8_t>(rand()%256) & byte;
+	uint8_t Vx = op_x();
+	uint8_t byte = op_kk();
+	_register[Vx] = random_byte(_random) & byte;
 }
 
 void chip8::OP_Dxyn()
 {
 	// Display n-byte sprite starting at memory location I at (Vx, Vy), set VF = collision.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
-	uint8_t Vy = (_opcode & 0x00F0u) >> 4;
-	uint8_t height = _opcode & 0x000Fu;
+	uint8_t Vx = op_x();
+	uint8_t Vy = op_y();
+	uint8_t height = op_n();
 
-	uint8_t xPos = _register[Vx] % 64;
-	uint8_t yPos = _register[Vy] % 32;
+	unsigned int xPos = _register[Vx] % 64;
+	unsigned int yPos = _register[Vy] % 32;
 
-	_register[0xF] = 0;
+	if (!_sprite_wrap)
+		height = static_cast<uint8_t>(std::min(height + yPos, 32u) - yPos);
 
-	for (size_t row = 0; row < height; ++row) {
-		uint8_t spriteByte = _memory[_index + row];
+	uint64_t collision = 0;
 
-		for (size_t col = 0; col < 8; ++col) {
-			uint8_t spritePixel = spriteByte & (0x80u >> col);
-			uint32_t* screenPixel = &_video[(31 - (yPos + row)) * 64 + (xPos + col)];
+	for (unsigned int row = 0; row < height; ++row) {
+		uint64_t sprite = static_cast<uint64_t>(_memory[(_index + row) & 0xFFFu]) << 56;
 
-			if (spritePixel) {
-				if (*screenPixel == 0xFFFFFFFF)
-					_register[0xF] = 1;
-				
-				*screenPixel ^= 0xFFFFFF00;
-			}
-		}
+		// A right rotation wraps the columns past x = 63, a shift drops them
+		if (_sprite_wrap)
+			sprite = (sprite >> xPos) | (sprite << ((64 - xPos) & 63u));
+		else
+			sprite >>= xPos;
+
+		unsigned int y = (yPos + row) % 32;
+		collision |= _display[y] & sprite;
+		_display[y] ^= sprite;
+		if (sprite)
+			_dirty_rows |= 1u << y;
 	}
+
+	_register[0xF] = collision != 0;
+	_events |= EVENT_DRAW;
 }
 
 void chip8::OP_Ex9E()
 {
 	// Skip next instruction if key with the value of Vx is pressed.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8u;
-	uint8_t key = _register[Vx];
+	uint8_t Vx = op_x();
+	uint8_t key = _register[Vx] & 0xFu;
 
 	if (_keypad[key])
 		_pc += 2;
@@ -448,8 +1571,8 @@ void chip8::OP_Ex9E()
 void chip8::OP_ExA1()
 {
 	// Skip next instruction if key with the value of Vx is not pressed.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
-	uint8_t key = _register[Vx];
+	uint8_t Vx = op_x();
+	uint8_t key = _register[Vx] & 0xFu;
 
 	if (!_keypad[key])
 		_pc += 2;
@@ -458,76 +1581,49 @@ void chip8::OP_ExA1()
 void chip8::OP_Fx07()
 {
 	// Set Vx = delay timer value.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
+	uint8_t Vx = op_x();
 	_register[Vx] = _delay_timer;
 }
 
 void chip8::OP_Fx0A()
 {
 	// Wait for a key press, store the value of the key in Vx.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
-
-	if (_keypad[0])
-		_register[Vx] = 0;
-	else if (_keypad[1])
-		_register[Vx] = 1;
-	else if (_keypad[2])
-		_register[Vx] = 2;
-	else if (_keypad[3])
-		_register[Vx] = 3;
-	else if (_keypad[4])
-		_register[Vx] = 4;
-	else if (_keypad[5])
-		_register[Vx] = 5;
-	else if (_keypad[6])
-		_register[Vx] = 6;
-	else if (_keypad[7])
-		_register[Vx] = 7;
-	else if (_keypad[8])
-		_register[Vx] = 8;
-	else if (_keypad[9])
-		_register[Vx] = 9;
-	else if (_keypad[10])
-		_register[Vx] = 10;
-	else if (_keypad[11])
-		_register[Vx] = 11;
-	else if (_keypad[12])
-		_register[Vx] = 12;
-	else if (_keypad[13])
-		_register[Vx] = 13;
-	else if (_keypad[14])
-		_register[Vx] = 14;
-	else if (_keypad[15])
-		_register[Vx] = 15;
-	else
-		_pc -= 2;
+	_halt_register = op_x();
+	_halted = true;
+
+	if (!resume())
+		_events |= EVENT_KEY_WAIT;
 }
 
 void chip8::OP_Fx15()
 {
 	// Set delay timer = Vx.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
+	uint8_t Vx = op_x();
 	_delay_timer = _register[Vx];
 }
 
 void chip8::OP_Fx18()
 {
 	// Set sound timer = Vx.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
+	uint8_t Vx = op_x();
+
+	if ((_sound_timer == 0) != (_register[Vx] == 0))
+		_events |= EVENT_SOUND;
+
 	_sound_timer = _register[Vx];
 }
 
 void chip8::OP_Fx1E()
 {
 	// Set I = I + Vx.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
+	uint8_t Vx = op_x();
 	_index += _register[Vx];
 }
 
 void chip8::OP_Fx29()
 {
 	// Set I = location of sprite for digit Vx.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
+	uint8_t Vx = op_x();
 	uint8_t digit = _register[Vx];
 	_index = FONTSET_START_ADDRESS + (5 * digit);
 }
@@ -535,38 +1631,42 @@ void chip8::OP_Fx29()
 void chip8::OP_Fx33()
 {
 	// Store BCD representation of Vx in memory locations I, I+1, and I+2.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
+	uint8_t Vx = op_x();
 	uint8_t value = _register[Vx];
 
 	// Ones-place
-	_memory[_index + 2] = value % 10;
+	_memory[(_index + 2) & 0xFFFu] = value % 10;
 	value /= 10;
 
 	// Tens-place
-	_memory[_index + 1] = value % 10;
+	_memory[(_index + 1) & 0xFFFu] = value % 10;
 	value /= 10;
 
 	// Hundreds-place
-	_memory[_index] = value % 10;
+	_memory[_index & 0xFFFu] = value % 10;
+
+	memory_written(_index, 3);
 }
 
 void chip8::OP_Fx55()
 {
 	// Store registers V0 through Vx in memory starting at location I.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
+	uint8_t Vx = op_x();
 
 	for (uint8_t i = 0; i <= Vx; ++i) {
-		_memory[_index + i] = _register[i];
+		_memory[(_index + i) & 0xFFFu] = _register[i];
 	}
+
+	memory_written(_index, Vx + 1u);
 }
 
 void chip8::OP_Fx65()
 {
 	// Read registers V0 through Vx from memory starting at location I.
-	uint8_t Vx = (_opcode & 0x0F00u) >> 8;
+	uint8_t Vx = op_x();
 
 	for (uint8_t i = 0; i <= Vx; ++i) {
-		_register[i] = _memory[_index + i];
+		_register[i] = _memory[(_index + i) & 0xFFFu];
 	}
 }
 
@@ -0,0 +1,196 @@
+#ifndef EMULATOR_THREAD_H
+#define EMULATOR_THREAD_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <chip8.h>
+#include <recorder.h>
+#include <triple_buffer.h>
+
+// Runs one or more cores on their own thread, one 60 Hz frame per 1/60 s
+// of wall time, so a stalled swap or driver call on the render thread can't
+// slow them down.
+//
+// Finished frames go through a triple buffer, the render thread presents
+// the newest complete one without taking a lock. Keypad state crosses the
+// other way as a bitmask, applied between frames to every core.
+class EmulatorThread {
+public:
+	// Every core's display, 32 rows each, in the order they were added
+	struct Frame {
+		std::vector<uint64_t> displays;
+	};
+
+	static const unsigned int MAX_CATCH_UP_FRAMES = 4;
+
+	EmulatorThread() = default;
+	~EmulatorThread() { stop(); }
+
+	// Before start()
+	void add(chip8& cpu) { _cpus.push_back(&cpu); }
+	size_t size() const { return _cpus.size(); }
+
+	EmulatorThread(const EmulatorThread&) = delete;
+	EmulatorThread& operator=(const EmulatorThread&) = delete;
+
+	inline void start();
+	inline void stop();
+
+	// Called from the input thread
+	inline void set_key(uint8_t key, bool pressed);
+
+	// Runs on the emulation thread after each frame is published, so the
+	// render loop can sleep until there is something new. Set before start().
+	void set_publish_callback(void (*callback)()) { _published = callback; }
+
+	// Gets every emulated frame of the first core, including the ones the
+	// render thread skips. Set before start().
+	void set_recorder(Recorder* recorder) { _recorder = recorder; }
+
+	// Called from the render thread
+	bool update() { return _frames.update(); }
+	const Frame& frame() const { return _frames.front(); }
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	std::vector<chip8*>     _cpus;
+	std::thread             _thread;
+	std::mutex              _mutex;
+	std::condition_variable _wake;
+	bool                    _running{ false };
+	std::atomic<uint16_t>   _keys{ 0 };
+	uint16_t                _applied_keys{ 0 };
+	TripleBuffer<Frame>     _frames;
+	void                  (*_published)(){ nullptr };
+	Recorder*               _recorder{ nullptr };
+
+	inline void run();
+	inline void apply_keys();
+	inline bool parked() const;
+};
+
+inline void EmulatorThread::start()
+{
+	_frames.reset(Frame{ std::vector<uint64_t>(_cpus.size() * 32, 0) });
+	_running = true;
+	_thread = std::thread(&EmulatorThread::run, this);
+}
+
+inline void EmulatorThread::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_running = false;
+	}
+	_wake.notify_one();
+
+	if (_thread.joinable())
+		_thread.join();
+}
+
+inline void EmulatorThread::set_key(uint8_t key, bool pressed)
+{
+	uint16_t bit = static_cast<uint16_t>(1u << (key & 0xFu));
+	{
+		// Held only so the wakeup can't slip in between the emulation
+		// thread checking the keys and going to sleep
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (pressed)
+			_keys.fetch_or(bit, std::memory_order_relaxed);
+		else
+			_keys.fetch_and(static_cast<uint16_t>(~bit), std::memory_order_relaxed);
+	}
+	_wake.notify_one();
+}
+
+inline void EmulatorThread::apply_keys()
+{
+	uint16_t keys = _keys.load(std::memory_order_relaxed);
+	uint16_t changed = keys ^ _applied_keys;
+	_applied_keys = keys;
+
+	for (uint8_t key = 0; changed; ++key, changed >>= 1) {
+		if (!(changed & 1u))
+			continue;
+		for (chip8* cpu : _cpus) {
+			if (keys & (1u << key))
+				cpu->press_key(key);
+			else
+				cpu->release_key(key);
+		}
+	}
+}
+
+// Every core parked on Fx0A with its timers stopped, nothing to do until a key arrives
+inline bool EmulatorThread::parked() const
+{
+	for (chip8* cpu : _cpus) {
+		if (!cpu->halted() || cpu->timers_active())
+			return false;
+	}
+	return true;
+}
+
+inline void EmulatorThread::run()
+{
+	const clock::duration interval = std::chrono::duration_cast<clock::duration>(
+		std::chrono::duration<double>(1.0 / TIMER_FREQUENCY));
+	clock::time_point next = clock::now();
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	while (_running) {
+		auto woken = [this] { return !_running || _keys.load(std::memory_order_relaxed) != _applied_keys; };
+
+		if (parked()) {
+			_wake.wait(lock, woken);
+			next = clock::now();
+		}
+		else {
+			_wake.wait_until(lock, next, woken);
+		}
+		if (!_running)
+			break;
+		lock.unlock();
+
+		apply_keys();
+
+		// After a long stall drop the backlog rather than fast-forwarding
+		clock::time_point now = clock::now();
+		unsigned int frames = 0;
+		while (now >= next && frames < MAX_CATCH_UP_FRAMES) {
+			for (chip8* cpu : _cpus)
+				cpu->run_until_frame();
+			if (_recorder && !_cpus.empty())
+				_recorder->record(_cpus[0]->display());
+			next += interval;
+			++frames;
+		}
+		if (now >= next)
+			next = now + interval;
+
+		bool dirty = false;
+		for (chip8* cpu : _cpus)
+			dirty |= cpu->take_dirty_rows() != 0;
+
+		if (dirty) {
+			uint64_t* displays = _frames.back().displays.data();
+			for (size_t i = 0; i < _cpus.size(); ++i)
+				memcpy(&displays[i * 32], _cpus[i]->display(), 32 * sizeof(uint64_t));
+			_frames.publish();
+			if (_published)
+				_published();
+		}
+
+		lock.lock();
+	}
+}
+
+#endif // !EMULATOR_THREAD_H
@@ -0,0 +1,241 @@
+#ifndef FARM_H
+#define FARM_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+#include <chip8.h>
+
+// Runs many independent chip8 jobs on a work-stealing pool, one worker per core.
+//
+// Jobs are dealt round-robin into per-worker queues. A worker takes from the
+// back of its own queue and runs that VM for one slice of run(), then puts
+// it back, so it keeps going with the job it started. A worker whose queue
+// is empty steals from the front of another's, where the jobs nobody has
+// started yet are. Each job's VM is a copy of the prototype passed to run(),
+// so clock and quirk settings and held keys are set on an ordinary chip8.
+class Farm {
+public:
+	struct Job {
+		const std::vector<uint8_t>* rom;
+		uint32_t seed;
+		uint64_t cycles;
+
+		// Filled in by run()
+		uint64_t     executed{ 0 };
+		uint64_t     display[32]{ 0 };
+		double       finished{ 0.0 };	// seconds from the start of run() until the last slice ended
+		double       busy{ 0.0 };	// seconds spent inside run() slices
+		unsigned int worker{ 0 };	// ran the last slice
+	};
+
+	static const uint64_t DEFAULT_SLICE = 100000;
+
+	// Zero workers means one per hardware thread
+	explicit Farm(unsigned int workers = 0)
+		: _workers(workers ? workers : std::max(std::thread::hardware_concurrency(), 1u)) {}
+
+	Farm(const Farm&) = delete;
+	Farm& operator=(const Farm&) = delete;
+
+	unsigned int workers() const { return _workers; }
+
+	// Instructions per run() call. Smaller slices give thieves more chances
+	// to take over a started job, larger ones cost less bookkeeping.
+	void set_slice(uint64_t cycles) { _slice = std::max<uint64_t>(cycles, 1); }
+
+	// Runs every job to completion, blocking until the last one finishes
+	inline void run(std::vector<Job>& jobs, const chip8& prototype);
+
+	// Per worker throughput, and latency percentiles over the jobs of the last run()
+	inline void report(std::ostream& out, const std::vector<Job>& jobs) const;
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	struct Task {
+		size_t job;
+		std::unique_ptr<chip8> cpu;	// created on the first slice
+	};
+
+	struct Queue {
+		std::mutex       mutex;
+		std::deque<Task> tasks;
+	};
+
+	struct Stats {
+		uint64_t jobs{ 0 };
+		uint64_t slices{ 0 };
+		uint64_t steals{ 0 };
+		uint64_t cycles{ 0 };
+		double   busy{ 0.0 };
+	};
+
+	unsigned int _workers;
+	uint64_t     _slice{ DEFAULT_SLICE };
+
+	// Valid during run()
+	std::vector<Job>*          _jobs{ nullptr };
+	const chip8*               _prototype{ nullptr };
+	std::unique_ptr<Queue[]>   _queues;
+	std::atomic<size_t>        _remaining{ 0 };
+	clock::time_point          _start{};
+
+	std::vector<Stats> _stats;
+	double             _elapsed{ 0.0 };
+
+	inline void worker(unsigned int index);
+	inline bool pop(unsigned int index, Task& task);
+	inline bool steal(unsigned int index, Task& task);
+	inline void push(unsigned int index, Task&& task);
+};
+
+inline void Farm::run(std::vector<Job>& jobs, const chip8& prototype)
+{
+	_jobs = &jobs;
+	_prototype = &prototype;
+	_queues.reset(new Queue[_workers]);
+	_stats.assign(_workers, Stats{});
+	_remaining = jobs.size();
+
+	for (size_t i = 0; i < jobs.size(); ++i)
+		_queues[i % _workers].tasks.push_back(Task{ i, nullptr });
+
+	_start = clock::now();
+	std::vector<std::thread> threads;
+	for (unsigned int i = 1; i < _workers; ++i)
+		threads.emplace_back(&Farm::worker, this, i);
+	worker(0);
+	for (std::thread& thread : threads)
+		thread.join();
+	_elapsed = std::chrono::duration<double>(clock::now() - _start).count();
+
+	_queues.reset();
+	_prototype = nullptr;
+	_jobs = nullptr;
+}
+
+inline void Farm::worker(unsigned int index)
+{
+	Stats& stats = _stats[index];
+
+	for (;;) {
+		Task task;
+		if (!pop(index, task) && !steal(index, task)) {
+			// Every job is either finished or being run by another worker
+			if (_remaining.load(std::memory_order_acquire) == 0)
+				break;
+			std::this_thread::yield();
+			continue;
+		}
+
+		Job& job = (*_jobs)[task.job];
+		if (!task.cpu) {
+			task.cpu = std::make_unique<chip8>(*_prototype);
+			task.cpu->load_rom(job.rom->data(), job.rom->size());
+			task.cpu->set_seed(job.seed);
+		}
+
+		clock::time_point start = clock::now();
+		uint64_t executed = job.executed < job.cycles ? task.cpu->run(std::min(_slice, job.cycles - job.executed), chip8::EVENT_NONE) : 0;
+		clock::time_point end = clock::now();
+
+		double seconds = std::chrono::duration<double>(end - start).count();
+		job.executed += executed;
+		job.busy += seconds;
+		stats.cycles += executed;
+		stats.busy += seconds;
+		++stats.slices;
+
+		if (job.executed < job.cycles) {
+			push(index, std::move(task));
+			continue;
+		}
+
+		memcpy(job.display, task.cpu->display(), sizeof(job.display));
+		job.finished = std::chrono::duration<double>(end - _start).count();
+		job.worker = index;
+		++stats.jobs;
+		_remaining.fetch_sub(1, std::memory_order_release);
+	}
+}
+
+inline bool Farm::pop(unsigned int index, Task& task)
+{
+	Queue& queue = _queues[index];
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.tasks.empty())
+		return false;
+
+	task = std::move(queue.tasks.back());
+	queue.tasks.pop_back();
+	return true;
+}
+
+inline bool Farm::steal(unsigned int index, Task& task)
+{
+	// Victims in order after this worker, so thieves don't all pile onto worker 0
+	for (unsigned int i = 1; i < _workers; ++i) {
+		Queue& queue = _queues[(index + i) % _workers];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (queue.tasks.empty())
+			continue;
+
+		task = std::move(queue.tasks.front());
+		queue.tasks.pop_front();
+		++_stats[index].steals;
+		return true;
+	}
+	return false;
+}
+
+inline void Farm::push(unsigned int index, Task&& task)
+{
+	Queue& queue = _queues[index];
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	queue.tasks.push_back(std::move(task));
+}
+
+inline void Farm::report(std::ostream& out, const std::vector<Job>& jobs) const
+{
+	uint64_t cycles = 0;
+	for (const Stats& stats : _stats)
+		cycles += stats.cycles;
+
+	out << "farm: " << jobs.size() << " jobs on " << _workers << " workers, " << cycles << " cycles in "
+		<< _elapsed << " s, " << static_cast<uint64_t>(_elapsed > 0.0 ? cycles / _elapsed : 0.0) << " cycles/sec" << std::endl;
+
+	for (size_t i = 0; i < _stats.size(); ++i) {
+		const Stats& stats = _stats[i];
+		out << "worker " << i << ": " << stats.jobs << " jobs, " << stats.slices << " slices, " << stats.steals << " steals, "
+			<< static_cast<uint64_t>(stats.busy > 0.0 ? stats.cycles / stats.busy : 0.0) << " cycles/sec, "
+			<< (_elapsed > 0.0 ? 100.0 * stats.busy / _elapsed : 0.0) << "% busy" << std::endl;
+	}
+
+	if (jobs.empty())
+		return;
+
+	// Nearest rank percentiles
+	auto percentiles = [&](const char* name, double Job::* field) {
+		std::vector<double> values;
+		for (const Job& job : jobs)
+			values.push_back(job.*field);
+		std::sort(values.begin(), values.end());
+
+		auto at = [&](double p) { return values[std::min(values.size() - 1, static_cast<size_t>(p * values.size()))] * 1e3; };
+		out << name << " ms: p50 " << at(0.50) << ", p90 " << at(0.90) << ", p99 " << at(0.99) << ", max " << values.back() * 1e3 << std::endl;
+	};
+	percentiles("job latency", &Job::finished);
+	percentiles("job run time", &Job::busy);
+}
+
+#endif // !FARM_H
@@ -0,0 +1,118 @@
+#ifndef FRAME_PACER_H
+#define FRAME_PACER_H
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <thread>
+
+// Decides when the render loop draws, and keeps track of how evenly it does.
+//
+// Nothing is drawn unless a new frame arrived or the window needs repainting.
+// Otherwise the loop blocks in wait(), which input, a published frame or a
+// refresh request interrupts. Presents are paced by vsync, or by sleeping to
+// an absolute deadline when vsync is off, so errors don't accumulate.
+class FramePacer {
+public:
+	static const unsigned int HISTOGRAM_BINS = 1000;
+	static constexpr double BIN_SECONDS = 0.00005;	// 50 us, so the histogram covers 50 ms of jitter
+	static constexpr double IDLE_TIMEOUT = 0.5;
+
+	explicit FramePacer(double interval) : _interval(interval) {}
+
+	// Needs a current context
+	void set_vsync(bool enabled) { _vsync = enabled; glfwSwapInterval(enabled ? 1 : 0); }
+
+	void request_redraw() { _redraw = true; }
+	bool redraw_pending() const { return _redraw; }
+
+	// Sleeps until an event arrives, unless a redraw is already due
+	inline void wait();
+
+	// Swaps buffers, no earlier than one interval after the last present
+	inline void present(GLFWwindow* window);
+
+	// Jitter is how far each present-to-present interval strays from the
+	// nominal one. Gaps while idle aren't counted.
+	inline double jitter_percentile(double percentile) const;
+	inline void report(std::ostream& out) const;
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	double            _interval;
+	bool              _vsync{ false };
+	bool              _redraw{ true };
+	clock::time_point _last_present{};
+	clock::time_point _deadline{};
+	uint64_t          _presents{ 0 };
+	uint64_t          _samples{ 0 };
+	uint32_t          _histogram[HISTOGRAM_BINS]{ 0 };
+};
+
+inline void FramePacer::wait()
+{
+	if (_redraw)
+		glfwPollEvents();
+	else
+		glfwWaitEventsTimeout(IDLE_TIMEOUT);
+}
+
+inline void FramePacer::present(GLFWwindow* window)
+{
+	clock::duration interval = std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(_interval));
+
+	if (!_vsync)
+		std::this_thread::sleep_until(_deadline);
+
+	glfwSwapBuffers(window);
+	_redraw = false;
+
+	clock::time_point now = clock::now();
+	if (_presents > 0) {
+		double elapsed = std::chrono::duration<double>(now - _last_present).count();
+
+		// Anything much longer than a frame is the loop idling, not jitter
+		if (elapsed < 4.0 * _interval) {
+			double jitter = elapsed > _interval ? elapsed - _interval : _interval - elapsed;
+			unsigned int bin = static_cast<unsigned int>(jitter / BIN_SECONDS);
+			++_histogram[bin < HISTOGRAM_BINS ? bin : HISTOGRAM_BINS - 1];
+			++_samples;
+		}
+	}
+	++_presents;
+	_last_present = now;
+
+	// Keep to the grid of deadlines, unless it has fallen behind
+	_deadline += interval;
+	if (_deadline < now)
+		_deadline = now + interval;
+}
+
+inline double FramePacer::jitter_percentile(double percentile) const
+{
+	uint64_t rank = static_cast<uint64_t>(percentile / 100.0 * _samples);
+	uint64_t seen = 0;
+
+	for (unsigned int bin = 0; bin < HISTOGRAM_BINS; ++bin) {
+		seen += _histogram[bin];
+		if (seen > rank)
+			return (bin + 1) * BIN_SECONDS;
+	}
+	return HISTOGRAM_BINS * BIN_SECONDS;
+}
+
+inline void FramePacer::report(std::ostream& out) const
+{
+	out << "frames (" << (_vsync ? "vsync" : "deadline") << "): " << _presents << " presented";
+	if (_samples > 0) {
+		out << ", jitter p50 " << jitter_percentile(50.0) * 1e3 << " ms, p95 " << jitter_percentile(95.0) * 1e3
+			<< " ms, p99 " << jitter_percentile(99.0) * 1e3 << " ms";
+	}
+	out << std::endl;
+}
+
+#endif // !FRAME_PACER_H
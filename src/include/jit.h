@@ -0,0 +1,674 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <iostream>
+#include <vector>
+
+#include <chip8.h>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CHIP8_JIT_X64 1
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+#endif
+
+const unsigned int JIT_MAX_BLOCK = 64;			// instructions per translated block
+const unsigned int JIT_MAX_BLOCK_BYTES = 8192;	// worst-case native size of one block
+const unsigned int JIT_DEFAULT_THRESHOLD = 32;	// interpreted visits before a block is translated
+const size_t       JIT_DEFAULT_CACHE_SIZE = 1 << 20;
+
+// Tiered x86-64 recompiler for a single chip8 instance.
+//
+// run() interprets until an address has been visited JIT_DEFAULT_THRESHOLD
+// times, then translates the basic block starting there. Translated blocks
+// keep the VM state in memory (rbx = chip8*, r12 = remaining cycle budget,
+// r13 = block table) and chain to each other through the block table at
+// 1nnn/2nnn/00EE and every other control transfer, only returning to run()
+// when the budget is spent or the successor has not been translated yet.
+//
+// Memory writes reported through chip8::set_write_hook drop every block
+// overlapping the written range. Instructions that can write memory end
+// their block, so a block never keeps running code it has just overwritten.
+//
+// On other hosts, or if executable memory cannot be allocated, run() simply
+// interprets.
+class chip8_jit {
+public:
+	inline chip8_jit(chip8& cpu, size_t cache_size = JIT_DEFAULT_CACHE_SIZE);
+	inline ~chip8_jit();
+
+	chip8_jit(const chip8_jit&) = delete;
+	chip8_jit& operator=(const chip8_jit&) = delete;
+
+	inline void run(uint64_t cycles);
+
+	void set_threshold(unsigned threshold) { _threshold = threshold; }
+
+	// Re-executes every translated block on an interpreted copy of the VM and
+	// compares the complete state afterwards. Chaining is disabled meanwhile.
+	void set_differential(bool enabled) { _differential = enabled; }
+
+	bool     available() const { return _code != nullptr; }
+	uint64_t blocks_compiled() const { return _blocks_compiled; }
+	uint64_t mismatches() const { return _mismatches; }
+
+private:
+	typedef uint64_t (*EntryFunc)(chip8*, uint64_t, const uint8_t*);
+
+	struct Block {
+		uint16_t start;
+		uint16_t end;
+	};
+
+	chip8& _cpu;
+
+	uint8_t*       _code{ nullptr };
+	uint8_t*       _cursor{ nullptr };
+	uint8_t*       _first_block{ nullptr };
+	size_t         _cache_size;
+	EntryFunc      _enter{ nullptr };
+	const uint8_t* _exit{ nullptr };
+
+	// Indexed by CHIP-8 address; _blocks is read directly by translated code
+	const uint8_t* _blocks[4096]{ nullptr };
+	uint8_t        _lengths[4096]{ 0 };
+	uint16_t       _hotness[4096]{ 0 };
+	uint64_t       _covered[4096 / 64]{ 0 };
+	std::vector<Block> _translated;
+
+	unsigned _threshold{ JIT_DEFAULT_THRESHOLD };
+	bool     _differential{ false };
+	uint64_t _blocks_compiled{ 0 };
+	uint64_t _mismatches{ 0 };
+
+	// Offsets of the chip8 members touched by translated code
+	uint32_t _off_register;
+	uint32_t _off_stack;
+	uint32_t _off_pc;
+	uint32_t _off_sp;
+	uint32_t _off_delay;
+	uint32_t _off_sound;
+	uint32_t _off_index;
+	uint32_t _off_time;
+	uint32_t _off_next_tick;
+
+	// Instruction costs the translated blocks were compiled with
+	uint32_t _costs[chip8::ID_COUNT]{ 0 };
+
+	static inline void on_write(void* user, uint16_t address, size_t length);
+	static inline void call_interpreter(chip8* cpu, uint32_t opcode);
+	static inline void tick_timers(chip8* cpu);
+
+	inline void invalidate(uint16_t address, size_t length);
+	inline void flush();
+	inline const uint8_t* compile(uint16_t start);
+	inline void run_differential(const uint8_t* block, uint8_t length);
+	inline bool compare(const chip8& jit, const chip8& interpreter, uint16_t start);
+
+	// Emitter
+	inline void emit(std::initializer_list<uint8_t> bytes);
+	inline void emit16(uint16_t value);
+	inline void emit32(uint32_t value);
+	inline void emit64(uint64_t value);
+	inline void emit_mem(std::initializer_list<uint8_t> opcode, uint8_t reg, uint32_t offset);
+	inline void emit_jump_exit(std::initializer_list<uint8_t> opcode);
+	inline void emit_flush_timers(unsigned& pending);
+	inline void emit_chain_static(uint16_t target, unsigned& pending);
+	inline void emit_chain_dynamic(unsigned& pending);
+	inline void emit_call(uint16_t address, uint16_t opcode, unsigned& pending);
+};
+
+chip8_jit::chip8_jit(chip8& cpu, size_t cache_size)
+	: _cpu(cpu), _cache_size(cache_size)
+{
+	const uint8_t* base = reinterpret_cast<const uint8_t*>(&cpu);
+	_off_register = static_cast<uint32_t>(reinterpret_cast<const uint8_t*>(&cpu._register) - base);
+	_off_stack = static_cast<uint32_t>(reinterpret_cast<const uint8_t*>(&cpu._stack) - base);
+	_off_pc = static_cast<uint32_t>(reinterpret_cast<const uint8_t*>(&cpu._pc) - base);
+	_off_sp = static_cast<uint32_t>(reinterpret_cast<const uint8_t*>(&cpu._sp) - base);
+	_off_delay = static_cast<uint32_t>(reinterpret_cast<const uint8_t*>(&cpu._delay_timer) - base);
+	_off_sound = static_cast<uint32_t>(reinterpret_cast<const uint8_t*>(&cpu._sound_timer) - base);
+	_off_index = static_cast<uint32_t>(reinterpret_cast<const uint8_t*>(&cpu._index) - base);
+	_off_time = static_cast<uint32_t>(reinterpret_cast<const uint8_t*>(&cpu._time) - base);
+	_off_next_tick = static_cast<uint32_t>(reinterpret_cast<const uint8_t*>(&cpu._next_tick) - base);
+
+#ifdef CHIP8_JIT_X64
+#if defined(_WIN32)
+	_code = static_cast<uint8_t*>(VirtualAlloc(nullptr, _cache_size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE));
+#else
+	void* code = mmap(nullptr, _cache_size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	_code = code == MAP_FAILED ? nullptr : static_cast<uint8_t*>(code);
+#endif
+	if (!_code) {
+		std::cerr << "JIT: could not allocate executable memory, interpreting only" << std::endl;
+		return;
+	}
+	_cursor = _code;
+
+	// Entry trampoline: enter(cpu, budget, block) -> remaining budget
+	_enter = reinterpret_cast<EntryFunc>(_cursor);
+	emit({ 0x53, 0x41, 0x54, 0x41, 0x55, 0x55 });	// push rbx, r12, r13, rbp
+#if defined(_WIN32)
+	emit({ 0x48, 0x83, 0xEC, 0x28 });				// sub rsp, 40 (shadow space)
+	emit({ 0x48, 0x89, 0xCB });						// mov rbx, rcx
+	emit({ 0x49, 0x89, 0xD4 });						// mov r12, rdx
+	emit({ 0x49, 0xBD });							// mov r13, _blocks
+	emit64(reinterpret_cast<uint64_t>(&_blocks[0]));
+	emit({ 0x41, 0xFF, 0xE0 });						// jmp r8
+#else
+	emit({ 0x48, 0x83, 0xEC, 0x08 });				// sub rsp, 8
+	emit({ 0x48, 0x89, 0xFB });						// mov rbx, rdi
+	emit({ 0x49, 0x89, 0xF4 });						// mov r12, rsi
+	emit({ 0x49, 0xBD });							// mov r13, _blocks
+	emit64(reinterpret_cast<uint64_t>(&_blocks[0]));
+	emit({ 0xFF, 0xE2 });							// jmp rdx
+#endif
+
+	// Common exit, every block leaves through here
+	_exit = _cursor;
+#if defined(_WIN32)
+	emit({ 0x48, 0x83, 0xC4, 0x28 });				// add rsp, 40
+#else
+	emit({ 0x48, 0x83, 0xC4, 0x08 });				// add rsp, 8
+#endif
+	emit({ 0x4C, 0x89, 0xE0 });						// mov rax, r12
+	emit({ 0x5D, 0x41, 0x5D, 0x41, 0x5C, 0x5B });	// pop rbp, r13, r12, rbx
+	emit({ 0xC3 });									// ret
+
+	_first_block = _cursor;
+	cpu.set_write_hook(&chip8_jit::on_write, this);
+#endif
+}
+
+chip8_jit::~chip8_jit()
+{
+	if (!_code)
+		return;
+
+	_cpu.set_write_hook(nullptr, nullptr);
+#ifdef CHIP8_JIT_X64
+#if defined(_WIN32)
+	VirtualFree(_code, 0, MEM_RELEASE);
+#else
+	munmap(_code, _cache_size);
+#endif
+#endif
+}
+
+void chip8_jit::run(uint64_t cycles)
+{
+	// Blocks charge the clock with the costs they were compiled with
+	if (memcmp(_costs, _cpu._costs, sizeof(_costs)) != 0) {
+		flush();
+		memcpy(_costs, _cpu._costs, sizeof(_costs));
+	}
+
+	while (cycles > 0) {
+		uint16_t pc = _cpu._pc;
+
+		if (_cpu._halted) {
+			cycles = _cpu.wait_for_key(cycles, chip8::EVENT_NONE);
+			continue;
+		}
+
+		if (_code && pc < 4096) {
+			const uint8_t* block = _blocks[pc];
+
+			if (!block && ++_hotness[pc] >= _threshold)
+				block = compile(pc);
+
+			if (block && _lengths[pc] <= cycles) {
+				if (_differential) {
+					run_differential(block, _lengths[pc]);
+					cycles -= _lengths[pc];
+				}
+				else {
+					cycles = _enter(&_cpu, cycles, block);
+				}
+				continue;
+			}
+		}
+
+		_cpu.cycle();
+		--cycles;
+	}
+}
+
+void chip8_jit::on_write(void* user, uint16_t address, size_t length)
+{
+	static_cast<chip8_jit*>(user)->invalidate(address, length);
+}
+
+void chip8_jit::call_interpreter(chip8* cpu, uint32_t opcode)
+{
+	cpu->execute_opcode(static_cast<uint16_t>(opcode));
+}
+
+void chip8_jit::tick_timers(chip8* cpu)
+{
+	cpu->tick_timers();
+}
+
+void chip8_jit::invalidate(uint16_t address, size_t length)
+{
+	size_t first = address;
+	size_t last = std::min<size_t>(address + length, 4096);
+
+	bool hit = false;
+	for (size_t i = first; i < last && !hit; ++i)
+		hit = (_covered[i / 64] >> (i % 64)) & 1u;
+	if (!hit)
+		return;
+
+	auto overlaps = [&](const Block& block) { return block.start < last && first < block.end; };
+	for (const Block& block : _translated) {
+		if (overlaps(block)) {
+			_blocks[block.start] = nullptr;
+			_hotness[block.start] = 0;
+		}
+	}
+	_translated.erase(std::remove_if(_translated.begin(), _translated.end(), overlaps), _translated.end());
+
+	// Blocks may overlap each other, so rebuild coverage from the survivors
+	memset(_covered, 0, sizeof(_covered));
+	for (const Block& block : _translated) {
+		for (size_t i = block.start; i < block.end; ++i)
+			_covered[i / 64] |= 1ull << (i % 64);
+	}
+}
+
+void chip8_jit::flush()
+{
+	memset(_blocks, 0, sizeof(_blocks));
+	memset(_covered, 0, sizeof(_covered));
+	_translated.clear();
+	_cursor = _first_block;
+}
+
+const uint8_t* chip8_jit::compile(uint16_t start)
+{
+	// Find the basic block: it ends at the first instruction that transfers
+	// control, may write memory, or waits for input.
+	uint16_t opcodes[JIT_MAX_BLOCK];
+	unsigned count = 0;
+	bool terminated = false;
+
+	for (uint32_t address = start; count < JIT_MAX_BLOCK && address + 1 < 4096 && !terminated; address += 2) {
+		uint16_t opcode = (_cpu._memory[address] << 8) | _cpu._memory[address + 1];
+		opcodes[count++] = opcode;
+
+		switch (chip8::decode(opcode)) {
+		case chip8::ID_00EE: case chip8::ID_1nnn: case chip8::ID_2nnn: case chip8::ID_3xkk:
+		case chip8::ID_4xkk: case chip8::ID_5xy0: case chip8::ID_9xy0: case chip8::ID_Bnnn:
+		case chip8::ID_Ex9E: case chip8::ID_ExA1: case chip8::ID_Fx0A: case chip8::ID_Fx33:
+		case chip8::ID_Fx55:
+			terminated = true;
+			break;
+		default:
+			break;
+		}
+	}
+
+	if (count == 0)
+		return nullptr;
+
+	if (static_cast<size_t>(_code + _cache_size - _cursor) < JIT_MAX_BLOCK_BYTES)
+		flush();
+
+	const uint8_t* entry = _cursor;
+	const uint32_t V = _off_register;
+	unsigned pending = 0;
+
+	// Prologue: leave without executing anything if the budget can't cover the whole block
+	emit({ 0x49, 0x83, 0xFC, static_cast<uint8_t>(count) });	// cmp r12, count
+	emit_jump_exit({ 0x0F, 0x82 });								// jb exit
+	emit({ 0x49, 0x83, 0xEC, static_cast<uint8_t>(count) });	// sub r12, count
+
+	for (unsigned i = 0; i < count; ++i) {
+		uint16_t opcode = opcodes[i];
+		uint16_t address = static_cast<uint16_t>(start + 2 * i);
+		uint8_t x = (opcode & 0x0F00u) >> 8;
+		uint8_t y = (opcode & 0x00F0u) >> 4;
+		uint8_t kk = opcode & 0x00FFu;
+		uint16_t nnn = opcode & 0x0FFFu;
+		uint8_t id = chip8::decode(opcode);
+		uint32_t cost = _costs[id];
+
+		switch (id) {
+		case chip8::ID_NULL:
+			pending += cost;
+			break;
+		case chip8::ID_6xkk:
+			emit_mem({ 0xC6 }, 0, V + x); emit({ kk });				// mov byte [Vx], kk
+			pending += cost;
+			break;
+		case chip8::ID_7xkk:
+			emit_mem({ 0x80 }, 0, V + x); emit({ kk });				// add byte [Vx], kk
+			pending += cost;
+			break;
+		case chip8::ID_8xy0:
+			emit_mem({ 0x8A }, 0, V + y);							// mov al, [Vy]
+			emit_mem({ 0x88 }, 0, V + x);							// mov [Vx], al
+			pending += cost;
+			break;
+		case chip8::ID_8xy1:
+		case chip8::ID_8xy2:
+		case chip8::ID_8xy3: {
+			static const uint8_t alu[] = { 0, 0x08, 0x20, 0x30 };	// or, and, xor
+			emit_mem({ 0x8A }, 0, V + y);							// mov al, [Vy]
+			emit_mem({ alu[opcode & 0x3u] }, 0, V + x);				// op [Vx], al
+			pending += cost;
+			break;
+		}
+		case chip8::ID_8xy4:
+			emit_mem({ 0x8A }, 0, V + x);							// mov al, [Vx]
+			emit_mem({ 0x02 }, 0, V + y);							// add al, [Vy]
+			emit({ 0x0F, 0x92, 0xC1 });								// setc cl
+			emit_mem({ 0x88 }, 1, V + 0xF);							// mov [VF], cl
+			emit_mem({ 0x88 }, 0, V + x);							// mov [Vx], al
+			pending += cost;
+			break;
+		case chip8::ID_8xy5:
+			emit_mem({ 0x8A }, 0, V + x);							// mov al, [Vx]
+			emit_mem({ 0x3A }, 0, V + y);							// cmp al, [Vy]
+			emit({ 0x0F, 0x97, 0xC1 });								// seta cl
+			emit_mem({ 0x88 }, 1, V + 0xF);							// mov [VF], cl
+			emit_mem({ 0x8A }, 0, V + y);							// mov al, [Vy]
+			emit_mem({ 0x28 }, 0, V + x);							// sub [Vx], al
+			pending += cost;
+			break;
+		case chip8::ID_8xy6:
+			emit_mem({ 0x8A }, 0, V + x);							// mov al, [Vx]
+			emit({ 0x24, 0x01 });									// and al, 1
+			emit_mem({ 0x88 }, 0, V + 0xF);							// mov [VF], al
+			emit_mem({ 0xD0 }, 5, V + x);							// shr byte [Vx], 1
+			pending += cost;
+			break;
+		case chip8::ID_8xy7:
+			emit_mem({ 0x8A }, 0, V + y);							// mov al, [Vy]
+			emit_mem({ 0x3A }, 0, V + x);							// cmp al, [Vx]
+			emit({ 0x0F, 0x97, 0xC1 });								// seta cl
+			emit_mem({ 0x88 }, 1, V + 0xF);							// mov [VF], cl
+			emit_mem({ 0x8A }, 0, V + y);							// mov al, [Vy]
+			emit_mem({ 0x2A }, 0, V + x);							// sub al, [Vx]
+			emit_mem({ 0x88 }, 0, V + x);							// mov [Vx], al
+			pending += cost;
+			break;
+		case chip8::ID_8xyE:
+			emit_mem({ 0x8A }, 0, V + x);							// mov al, [Vx]
+			emit({ 0xC0, 0xE8, 0x07 });								// shr al, 7
+			emit_mem({ 0x88 }, 0, V + 0xF);							// mov [VF], al
+			emit_mem({ 0xD0 }, 4, V + x);							// shl byte [Vx], 1
+			pending += cost;
+			break;
+		case chip8::ID_Annn:
+			emit_mem({ 0x66, 0xC7 }, 0, _off_index); emit16(nnn);	// mov word [I], nnn
+			pending += cost;
+			break;
+		case chip8::ID_Fx1E:
+			emit_mem({ 0x0F, 0xB6 }, 0, V + x);						// movzx eax, byte [Vx]
+			emit_mem({ 0x66, 0x01 }, 0, _off_index);				// add [I], ax
+			pending += cost;
+			break;
+		case chip8::ID_Fx29:
+			emit_mem({ 0x0F, 0xB6 }, 0, V + x);						// movzx eax, byte [Vx]
+			emit({ 0x8D, 0x44, 0x80, static_cast<uint8_t>(FONTSET_START_ADDRESS) });	// lea eax, [rax*5 + font]
+			emit_mem({ 0x66, 0x89 }, 0, _off_index);				// mov [I], ax
+			pending += cost;
+			break;
+		case chip8::ID_Fx07:
+			emit_flush_timers(pending);
+			emit_mem({ 0x8A }, 0, _off_delay);						// mov al, [delay]
+			emit_mem({ 0x88 }, 0, V + x);							// mov [Vx], al
+			pending = cost;
+			break;
+		case chip8::ID_Fx15:
+		case chip8::ID_Fx18:
+			emit_flush_timers(pending);
+			emit_mem({ 0x8A }, 0, V + x);							// mov al, [Vx]
+			emit_mem({ 0x88 }, 0, (opcode & 0xFFu) == 0x15 ? _off_delay : _off_sound);
+			pending = cost;
+			break;
+
+		// Block terminators
+		case chip8::ID_1nnn:
+			pending += cost;
+			emit_chain_static(nnn, pending);
+			break;
+		case chip8::ID_2nnn:
+			emit_mem({ 0x0F, 0xB6 }, 0, _off_sp);					// movzx eax, byte [sp]
+			emit({ 0x66, 0xC7, 0x84, 0x43 }); emit32(_off_stack); emit16(address + 2);	// mov word [stack + rax*2], ret
+			emit({ 0xFE, 0xC0, 0x24, 0x0F });						// inc al; and al, 0xF
+			emit_mem({ 0x88 }, 0, _off_sp);							// mov [sp], al
+			pending += cost;
+			emit_chain_static(nnn, pending);
+			break;
+		case chip8::ID_00EE:
+			emit_mem({ 0x0F, 0xB6 }, 0, _off_sp);					// movzx eax, byte [sp]
+			emit({ 0xFF, 0xC8, 0x83, 0xE0, 0x0F });					// dec eax; and eax, 0xF
+			emit_mem({ 0x88 }, 0, _off_sp);							// mov [sp], al
+			emit({ 0x0F, 0xB7, 0x8C, 0x43 }); emit32(_off_stack);	// movzx ecx, word [stack + rax*2]
+			emit_mem({ 0x66, 0x89 }, 1, _off_pc);					// mov [pc], cx
+			pending += cost;
+			emit_chain_dynamic(pending);
+			break;
+		case chip8::ID_3xkk:
+		case chip8::ID_4xkk:
+		case chip8::ID_5xy0:
+		case chip8::ID_9xy0: {
+			bool equal = (opcode >> 12) == 0x3 || (opcode >> 12) == 0x5;
+			emit({ 0xB9 }); emit32(address + 2u);					// mov ecx, next
+			emit({ 0xBA }); emit32(address + 4u);					// mov edx, next + 2
+			if ((opcode >> 12) == 0x3 || (opcode >> 12) == 0x4) {
+				emit_mem({ 0x80 }, 7, V + x); emit({ kk });			// cmp byte [Vx], kk
+			}
+			else {
+				emit_mem({ 0x8A }, 0, V + x);						// mov al, [Vx]
+				emit_mem({ 0x3A }, 0, V + y);						// cmp al, [Vy]
+			}
+			emit({ 0x0F, static_cast<uint8_t>(equal ? 0x44 : 0x45), 0xCA });	// cmove/cmovne ecx, edx
+			emit_mem({ 0x66, 0x89 }, 1, _off_pc);					// mov [pc], cx
+			pending += cost;
+			emit_chain_dynamic(pending);
+			break;
+		}
+		case chip8::ID_Bnnn:
+			emit_mem({ 0x0F, 0xB6 }, 1, V);							// movzx ecx, byte [V0]
+			emit({ 0x81, 0xC1 }); emit32(nnn);						// add ecx, nnn
+			emit_mem({ 0x66, 0x89 }, 1, _off_pc);					// mov [pc], cx
+			pending += cost;
+			emit_chain_dynamic(pending);
+			break;
+		case chip8::ID_Fx0A:
+			// The CPU may now be parked, leave so run() can wait for the key
+			emit_call(address, opcode, pending);
+			emit_flush_timers(pending);
+			emit_jump_exit({ 0xE9 });								// jmp exit
+			break;
+		case chip8::ID_Ex9E:
+		case chip8::ID_ExA1:
+		case chip8::ID_Fx33:
+		case chip8::ID_Fx55:
+			emit_call(address, opcode, pending);
+			emit_mem({ 0x0F, 0xB7 }, 1, _off_pc);					// movzx ecx, word [pc]
+			emit_chain_dynamic(pending);
+			break;
+
+		// Everything else goes through the interpreter's handlers
+		default:
+			emit_call(address, opcode, pending);
+			break;
+		}
+	}
+
+	if (!terminated) {
+		uint32_t next = start + 2u * count;
+		if (next < 4096) {
+			emit_chain_static(static_cast<uint16_t>(next), pending);
+		}
+		else {
+			emit_mem({ 0x66, 0xC7 }, 0, _off_pc); emit16(static_cast<uint16_t>(next));
+			emit_flush_timers(pending);
+			emit_jump_exit({ 0xE9 });
+		}
+	}
+
+	Block block{ start, static_cast<uint16_t>(start + 2 * count) };
+	for (size_t i = block.start; i < block.end; ++i)
+		_covered[i / 64] |= 1ull << (i % 64);
+	_translated.push_back(block);
+
+	_blocks[start] = entry;
+	_lengths[start] = static_cast<uint8_t>(count);
+	++_blocks_compiled;
+	return entry;
+}
+
+void chip8_jit::run_differential(const uint8_t* block, uint8_t length)
+{
+	uint16_t start = _cpu._pc;
+
+	// The copy takes the random state too, so Cxkk draws the same bytes on both sides
+	chip8 interpreter = _cpu;
+	interpreter.set_write_hook(nullptr, nullptr);
+
+	_enter(&_cpu, length, block);
+
+	for (uint8_t i = 0; i < length; ++i)
+		interpreter.cycle();
+
+	if (!compare(_cpu, interpreter, start))
+		++_mismatches;
+}
+
+bool chip8_jit::compare(const chip8& jit, const chip8& interpreter, uint16_t start)
+{
+	bool same = true;
+	auto check = [&](const char* what, const void* a, const void* b, size_t size) {
+		if (memcmp(a, b, size) != 0) {
+			std::cerr << "JIT mismatch in " << what << " after block 0x" << std::hex << start << std::dec << std::endl;
+			same = false;
+		}
+	};
+
+	check("memory", jit._memory, interpreter._memory, sizeof(jit._memory));
+	check("registers", jit._register, interpreter._register, sizeof(jit._register));
+	check("stack", jit._stack, interpreter._stack, sizeof(jit._stack));
+	check("pc", &jit._pc, &interpreter._pc, sizeof(jit._pc));
+	check("sp", &jit._sp, &interpreter._sp, sizeof(jit._sp));
+	check("index", &jit._index, &interpreter._index, sizeof(jit._index));
+	check("delay timer", &jit._delay_timer, &interpreter._delay_timer, sizeof(jit._delay_timer));
+	check("sound timer", &jit._sound_timer, &interpreter._sound_timer, sizeof(jit._sound_timer));
+	check("halted", &jit._halted, &interpreter._halted, sizeof(jit._halted));
+	check("clock", &jit._time, &interpreter._time, sizeof(jit._time));
+	check("display", jit._display, interpreter._display, sizeof(jit._display));
+	return same;
+}
+
+void chip8_jit::emit(std::initializer_list<uint8_t> bytes)
+{
+	for (uint8_t byte : bytes)
+		*_cursor++ = byte;
+}
+
+void chip8_jit::emit16(uint16_t value)
+{
+	memcpy(_cursor, &value, sizeof(value));
+	_cursor += sizeof(value);
+}
+
+void chip8_jit::emit32(uint32_t value)
+{
+	memcpy(_cursor, &value, sizeof(value));
+	_cursor += sizeof(value);
+}
+
+void chip8_jit::emit64(uint64_t value)
+{
+	memcpy(_cursor, &value, sizeof(value));
+	_cursor += sizeof(value);
+}
+
+void chip8_jit::emit_mem(std::initializer_list<uint8_t> opcode, uint8_t reg, uint32_t offset)
+{
+	// <opcode> reg, [rbx + disp32]
+	emit(opcode);
+	emit({ static_cast<uint8_t>(0x83 | (reg << 3)) });
+	emit32(offset);
+}
+
+void chip8_jit::emit_jump_exit(std::initializer_list<uint8_t> opcode)
+{
+	emit(opcode);
+	emit32(static_cast<uint32_t>(_exit - (_cursor + 4)));
+}
+
+void chip8_jit::emit_flush_timers(unsigned& pending)
+{
+	// Charge the clock for the instructions run since the last flush, and
+	// tick the timers out of line when that crosses a 60 Hz boundary
+	if (pending == 0)
+		return;
+
+	emit_mem({ 0x48, 0x81 }, 0, _off_time); emit32(pending);		// add qword [time], pending
+	emit_mem({ 0x48, 0x8B }, 0, _off_time);							// mov rax, [time]
+	emit_mem({ 0x48, 0x3B }, 0, _off_next_tick);					// cmp rax, [next_tick]
+	emit({ 0x72, 22 });												// jb +22
+#if defined(_WIN32)
+	emit({ 0x48, 0x89, 0xD9 });										// mov rcx, rbx
+#else
+	emit({ 0x48, 0x89, 0xDF });										// mov rdi, rbx
+#endif
+	emit({ 0x48, 0xB8 }); emit64(reinterpret_cast<uint64_t>(&chip8_jit::tick_timers));	// mov rax, helper
+	emit({ 0xFF, 0xD0 });											// call rax
+	emit_mem({ 0x0F, 0xB7 }, 1, _off_pc);							// movzx ecx, word [pc]
+	pending = 0;
+}
+
+void chip8_jit::emit_chain_static(uint16_t target, unsigned& pending)
+{
+	emit_mem({ 0x66, 0xC7 }, 0, _off_pc); emit16(target);			// mov word [pc], target
+	emit_flush_timers(pending);
+	emit({ 0x49, 0x8B, 0x85 }); emit32(target * 8u);				// mov rax, [r13 + target*8]
+	emit({ 0x48, 0x85, 0xC0 });										// test rax, rax
+	emit_jump_exit({ 0x0F, 0x84 });									// jz exit
+	emit({ 0xFF, 0xE0 });											// jmp rax
+}
+
+void chip8_jit::emit_chain_dynamic(unsigned& pending)
+{
+	// ecx holds the new PC, already stored to [pc]
+	emit_flush_timers(pending);
+	emit({ 0x81, 0xF9 }); emit32(0xFFF);							// cmp ecx, 0xFFF
+	emit_jump_exit({ 0x0F, 0x87 });									// ja exit
+	emit({ 0x49, 0x8B, 0x44, 0xCD, 0x00 });							// mov rax, [r13 + rcx*8]
+	emit({ 0x48, 0x85, 0xC0 });										// test rax, rax
+	emit_jump_exit({ 0x0F, 0x84 });									// jz exit
+	emit({ 0xFF, 0xE0 });											// jmp rax
+}
+
+void chip8_jit::emit_call(uint16_t address, uint16_t opcode, unsigned& pending)
+{
+	emit_flush_timers(pending);
+	emit_mem({ 0x66, 0xC7 }, 0, _off_pc); emit16(address + 2);		// mov word [pc], next
+#if defined(_WIN32)
+	emit({ 0x48, 0x89, 0xD9 });										// mov rcx, rbx
+	emit({ 0xBA }); emit32(opcode);									// mov edx, opcode
+#else
+	emit({ 0x48, 0x89, 0xDF });										// mov rdi, rbx
+	emit({ 0xBE }); emit32(opcode);									// mov esi, opcode
+#endif
+	emit({ 0x48, 0xB8 }); emit64(reinterpret_cast<uint64_t>(&chip8_jit::call_interpreter));	// mov rax, helper
+	emit({ 0xFF, 0xD0 });											// call rax
+	pending = _costs[chip8::decode(opcode)];
+}
+
+#endif // !JIT_H
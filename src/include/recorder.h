@@ -0,0 +1,375 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <scaler.h>
+
+// Records the display once per 60 Hz frame, encoding on a writer thread.
+//
+// record() runs on the emulation thread and never blocks. Identical frames
+// in a row are collapsed into one entry with a repeat count before they are
+// queued. If the writer falls so far behind that the queue is full, frames
+// are dropped and counted rather than waited on.
+class Recorder {
+public:
+	enum Format {
+		FORMAT_Y4M,	// 8-bit greyscale YUV4MPEG2, 60 fps
+		FORMAT_GIF,	// animated GIF with a black and white palette
+		FORMAT_RAW,	// 256 bytes per frame, the display rows most significant bit first
+	};
+
+	static const size_t QUEUE_SIZE = 256;	// power of two
+
+	Recorder() : _queue(QUEUE_SIZE) {}
+	~Recorder() { close(); }
+
+	Recorder(const Recorder&) = delete;
+	Recorder& operator=(const Recorder&) = delete;
+
+	// Picks the format from the extension: .y4m, .gif, anything else is raw
+	inline bool open(const std::string& path);
+	inline bool open(const std::string& path, Format format);
+	inline void close();
+	bool is_open() const { return _thread.joinable(); }
+
+	// Y4M and GIF frames are upscaled on the writer thread, raw stays 1bpp. Set before open().
+	inline bool set_scale(unsigned int factor, Scaler::Filter filter = Scaler::FILTER_NEAREST);
+
+	// Called once per frame by the emulation thread
+	inline void record(const uint64_t* display);
+
+	uint64_t frames() const { return _frames; }
+	uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+	uint64_t written() const { return _written.load(std::memory_order_relaxed); }
+	inline void report(std::ostream& out) const;
+
+private:
+	struct Entry {
+		uint64_t display[32];
+		uint32_t repeat;
+	};
+
+	std::ofstream           _file;
+	Format                  _format{ FORMAT_RAW };
+	std::thread             _thread;
+	std::mutex              _mutex;
+	std::condition_variable _wake;
+	std::atomic<bool>       _closing{ false };
+
+	// Single producer, single consumer ring
+	std::vector<Entry>      _queue;
+	std::atomic<size_t>     _head{ 0 };	// next entry the writer reads
+	std::atomic<size_t>     _tail{ 0 };	// next entry the emulation thread fills
+
+	// Emulation thread only. The newest frame is held back until a different one arrives.
+	Entry                   _pending{};
+	bool                    _has_pending{ false };
+	uint64_t                _frames{ 0 };
+
+	std::atomic<uint64_t>   _dropped{ 0 };
+	std::atomic<uint64_t>   _written{ 0 };
+
+	unsigned int            _scale{ 1 };
+	Scaler::Filter          _filter{ Scaler::FILTER_NEAREST };
+
+	// Writer thread only
+	Scaler                  _scaler;
+	std::vector<uint8_t>    _indices;
+	std::vector<uint8_t>    _image;	// one palette index per pixel, after scaling
+	uint32_t                _gif_remainder{ 0 };
+	uint16_t                _gif_codes[4096][2];	// LZW table, (prefix, pixel) -> code
+
+	inline void submit();
+	inline void writer();
+	unsigned int width() const { return 64 * _scale; }
+	unsigned int height() const { return 32 * _scale; }
+	inline const uint8_t* scaled(const Entry& entry);
+	inline void write_header();
+	inline void write_entry(const Entry& entry);
+	inline void write_gif_image(const Entry& entry, uint16_t delay);
+};
+
+inline bool Recorder::open(const std::string& path)
+{
+	auto ends_with = [&](const char* suffix) {
+		size_t length = strlen(suffix);
+		return path.size() >= length && path.compare(path.size() - length, length, suffix) == 0;
+	};
+
+	if (ends_with(".y4m"))
+		return open(path, FORMAT_Y4M);
+	if (ends_with(".gif"))
+		return open(path, FORMAT_GIF);
+	return open(path, FORMAT_RAW);
+}
+
+inline bool Recorder::open(const std::string& path, Format format)
+{
+	close();
+
+	_file.open(path, std::ios::binary | std::ios::trunc);
+	if (!_file.is_open())
+		return false;
+
+	_format = format;
+	_closing = false;
+	_head = 0;
+	_tail = 0;
+	_has_pending = false;
+	_frames = 0;
+	_dropped = 0;
+	_written = 0;
+	_gif_remainder = 0;
+
+	write_header();
+	_thread = std::thread(&Recorder::writer, this);
+	return true;
+}
+
+inline bool Recorder::set_scale(unsigned int factor, Scaler::Filter filter)
+{
+	unsigned int step = filter == Scaler::FILTER_SCALE2X ? 2 : filter == Scaler::FILTER_SCALE3X ? 3 : 1;
+	if (is_open() || factor == 0 || factor % step != 0)
+		return false;
+
+	_scale = factor;
+	_filter = filter;
+	return true;
+}
+
+inline void Recorder::close()
+{
+	if (!is_open())
+		return;
+
+	if (_has_pending)
+		submit();
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_closing = true;
+	}
+	_wake.notify_one();
+	_thread.join();
+
+	if (_format == FORMAT_GIF)
+		_file.put(0x3B);
+	_file.close();
+}
+
+inline void Recorder::record(const uint64_t* display)
+{
+	if (!is_open())
+		return;
+	++_frames;
+
+	if (_has_pending && memcmp(_pending.display, display, sizeof(_pending.display)) == 0) {
+		++_pending.repeat;
+		return;
+	}
+
+	if (_has_pending)
+		submit();
+
+	memcpy(_pending.display, display, sizeof(_pending.display));
+	_pending.repeat = 1;
+	_has_pending = true;
+}
+
+inline void Recorder::submit()
+{
+	size_t tail = _tail.load(std::memory_order_relaxed);
+
+	if (tail - _head.load(std::memory_order_acquire) == _queue.size()) {
+		_dropped.fetch_add(_pending.repeat, std::memory_order_relaxed);
+	}
+	else {
+		_queue[tail & (_queue.size() - 1)] = _pending;
+		_tail.store(tail + 1, std::memory_order_release);
+
+		// Doesn't wait for the writer, a missed wakeup only costs its poll interval
+		_wake.notify_one();
+	}
+	_has_pending = false;
+}
+
+inline void Recorder::writer()
+{
+	for (;;) {
+		size_t head = _head.load(std::memory_order_relaxed);
+
+		if (head == _tail.load(std::memory_order_acquire)) {
+			if (_closing)
+				break;
+
+			std::unique_lock<std::mutex> lock(_mutex);
+			_wake.wait_for(lock, std::chrono::milliseconds(10));
+			continue;
+		}
+
+		write_entry(_queue[head & (_queue.size() - 1)]);
+		_head.store(head + 1, std::memory_order_release);
+	}
+	_file.flush();
+}
+
+inline void Recorder::write_header()
+{
+	if (_format == FORMAT_Y4M) {
+		_file << "YUV4MPEG2 W" << width() << " H" << height() << " F60:1 Ip A1:1 Cmono\n";
+	}
+	else if (_format == FORMAT_GIF) {
+		const uint8_t header[] = {
+			'G', 'I', 'F', '8', '9', 'a',
+			static_cast<uint8_t>(width() & 0xFF), static_cast<uint8_t>(width() >> 8),
+			static_cast<uint8_t>(height() & 0xFF), static_cast<uint8_t>(height() >> 8),
+			0x80, 0, 0,			// global colour table of two entries
+			0x00, 0x00, 0x00, 0xFF, 0xFF, 0xFF,
+			0x21, 0xFF, 11, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0',
+			3, 1, 0, 0, 0,			// loop forever
+		};
+		_file.write(reinterpret_cast<const char*>(header), sizeof(header));
+	}
+}
+
+inline void Recorder::write_entry(const Entry& entry)
+{
+	_written.fetch_add(entry.repeat, std::memory_order_relaxed);
+
+	if (_format == FORMAT_GIF) {
+		// Delays are in hundredths of a second, carry the rounding error forward
+		uint32_t sixtieths = entry.repeat * 100 + _gif_remainder;
+		uint32_t delay = sixtieths / 60;
+		_gif_remainder = sixtieths % 60;
+
+		do {
+			uint16_t part = static_cast<uint16_t>(std::min<uint32_t>(delay, 0xFFFF));
+			write_gif_image(entry, part);
+			delay -= part;
+		} while (delay > 0);
+		return;
+	}
+
+	if (_format == FORMAT_Y4M) {
+		// Studio range, the indices are 0 or 1
+		const uint8_t* image = scaled(entry);
+		std::vector<char> luma(static_cast<size_t>(width()) * height());
+		for (size_t i = 0; i < luma.size(); ++i)
+			luma[i] = static_cast<char>(0x10 + image[i] * (0xEB - 0x10));
+
+		for (uint32_t i = 0; i < entry.repeat; ++i) {
+			_file << "FRAME\n";
+			_file.write(luma.data(), luma.size());
+		}
+		return;
+	}
+
+	for (uint32_t i = 0; i < entry.repeat; ++i) {
+		for (unsigned int y = 0; y < 32; ++y) {
+			for (int shift = 56; shift >= 0; shift -= 8)
+				_file.put(static_cast<char>((entry.display[y] >> shift) & 0xFFu));
+		}
+	}
+}
+
+inline const uint8_t* Recorder::scaled(const Entry& entry)
+{
+	_indices.resize(64 * 32);
+	_image.resize(static_cast<size_t>(width()) * height());
+	_scaler.unpack(entry.display, 64, 32, _indices.data());
+	if (_scale == 1)
+		return _indices.data();
+
+	_scaler.upscale(_indices.data(), 64, 32, _filter, _scale, _image.data());
+	return _image.data();
+}
+
+inline void Recorder::write_gif_image(const Entry& entry, uint16_t delay)
+{
+	const uint8_t control[] = {
+		0x21, 0xF9, 4, 0x00, static_cast<uint8_t>(delay & 0xFF), static_cast<uint8_t>(delay >> 8), 0, 0,
+		0x2C, 0, 0, 0, 0,
+		static_cast<uint8_t>(width() & 0xFF), static_cast<uint8_t>(width() >> 8),
+		static_cast<uint8_t>(height() & 0xFF), static_cast<uint8_t>(height() >> 8), 0x00,
+		2,				// LZW minimum code size, the smallest GIF allows
+	};
+	_file.write(reinterpret_cast<const char*>(control), sizeof(control));
+
+	// LZW over the pixel indices, codes packed least significant bit first
+	const uint8_t* image = scaled(entry);
+	const size_t pixels = static_cast<size_t>(width()) * height();
+	const unsigned int CLEAR = 4, END = 5;
+	std::vector<uint8_t> data;
+	uint32_t bits = 0;
+	unsigned int bit_count = 0, code_size = 3, free_code = END + 1;
+
+	auto emit = [&](unsigned int code) {
+		bits |= code << bit_count;
+		bit_count += code_size;
+		while (bit_count >= 8) {
+			data.push_back(static_cast<uint8_t>(bits));
+			bits >>= 8;
+			bit_count -= 8;
+		}
+	};
+	auto reset = [&]() {
+		memset(_gif_codes, 0, sizeof(_gif_codes));
+		code_size = 3;
+		free_code = END + 1;
+	};
+
+	reset();
+	emit(CLEAR);
+
+	unsigned int prefix = image[0];
+	for (size_t i = 1; i < pixels; ++i) {
+		unsigned int pixel = image[i];
+
+		if (_gif_codes[prefix][pixel]) {
+			prefix = _gif_codes[prefix][pixel];
+			continue;
+		}
+
+		emit(prefix);
+		if (free_code < 4096) {
+			_gif_codes[prefix][pixel] = static_cast<uint16_t>(free_code);
+			if (free_code++ == (1u << code_size) && code_size < 12)
+				++code_size;
+		}
+		else {
+			emit(CLEAR);
+			reset();
+		}
+		prefix = pixel;
+	}
+	emit(prefix);
+	emit(END);
+	if (bit_count > 0)
+		data.push_back(static_cast<uint8_t>(bits));
+
+	for (size_t offset = 0; offset < data.size(); offset += 255) {
+		size_t length = std::min<size_t>(255, data.size() - offset);
+		_file.put(static_cast<char>(length));
+		_file.write(reinterpret_cast<const char*>(&data[offset]), length);
+	}
+	_file.put(0);
+}
+
+inline void Recorder::report(std::ostream& out) const
+{
+	out << "recorded " << written() << " of " << frames() << " frames, " << dropped() << " dropped" << std::endl;
+}
+
+#endif // !RECORDER_H
@@ -0,0 +1,569 @@
+#ifndef SCALER_H
+#define SCALER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define CHIP8_SCALER_X64 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// AVX2 kernels are compiled for AVX2 on their own and only called when the CPU has it
+#if defined(CHIP8_SCALER_X64) && defined(__GNUC__)
+#define CHIP8_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define CHIP8_TARGET_AVX2
+#endif
+
+// CPU upscaler for screenshots and frame export.
+//
+// Works on displays packed like chip8::display(), width / 64 words per row,
+// so 64x32 and 128x64 both fit. unpack() turns them into one palette index
+// per byte. nearest(), scale2x() and scale3x() enlarge index images, and
+// map() looks indices up in a palette of RGBA words. render() does all of it
+// in one pass for the common case of a large nearest-neighbour export.
+//
+// Each kernel has a scalar version and SSE2 and AVX2 versions on x86-64,
+// picked by CPUID at construction. Output never depends on which one ran.
+class Scaler {
+public:
+	enum Isa {
+		ISA_SCALAR,
+		ISA_SSE2,
+		ISA_AVX2,
+	};
+
+	enum Filter {
+		FILTER_NEAREST,
+		FILTER_SCALE2X,	// EPX, then nearest for the rest of the factor
+		FILTER_SCALE3X,
+	};
+
+	inline Scaler();
+
+	// Lowering the instruction set is for comparing kernels, it can't be raised past what the CPU has
+	void set_isa(Isa isa) { _isa = std::min(isa, _detected); }
+	Isa isa() const { return _isa; }
+	static const char* isa_name(Isa isa) { return isa == ISA_AVX2 ? "avx2" : isa == ISA_SSE2 ? "sse2" : "scalar"; }
+
+	inline void unpack(const uint64_t* rows, unsigned int width, unsigned int height, uint8_t* out) const;
+	inline void nearest(const uint8_t* in, unsigned int width, unsigned int height, unsigned int factor, uint8_t* out) const;
+	inline void scale2x(const uint8_t* in, unsigned int width, unsigned int height, uint8_t* out) const;
+	inline void scale3x(const uint8_t* in, unsigned int width, unsigned int height, uint8_t* out) const;
+	inline void map(const uint8_t* in, size_t count, const uint32_t* palette, unsigned int palette_size, uint32_t* out) const;
+
+	// Any filter at any factor it divides, index output of (width * factor) x (height * factor)
+	inline bool upscale(const uint8_t* in, unsigned int width, unsigned int height, Filter filter, unsigned int factor, uint8_t* out) const;
+
+	// Packed display straight to RGBA, nearest neighbour, palette[0] off and palette[1] on
+	inline void render(const uint64_t* rows, unsigned int width, unsigned int height, unsigned int factor,
+		const uint32_t palette[2], uint32_t* out) const;
+
+private:
+	Isa _detected{ ISA_SCALAR };
+	Isa _isa{ ISA_SCALAR };
+
+	// Scratch for multi-pass filters and render()
+	mutable std::vector<uint8_t>  _indices;
+	mutable std::vector<uint32_t> _colors;
+	mutable std::vector<uint8_t>  _padded;
+
+	// One row, each pixel repeated `factor` times
+	template <typename T>
+	static void widen_scalar(const T* in, unsigned int width, unsigned int factor, T* out);
+	inline void widen(const uint8_t* in, unsigned int width, unsigned int factor, uint8_t* out) const;
+	inline void widen(const uint32_t* in, unsigned int width, unsigned int factor, uint32_t* out) const;
+
+	inline const uint8_t* pad(const uint8_t* in, unsigned int width, unsigned int height) const;
+
+#if defined(CHIP8_SCALER_X64)
+	static inline void unpack_sse2(const uint64_t* rows, size_t words, uint8_t* out);
+	static inline void widen_sse2(const uint8_t* in, unsigned int width, unsigned int factor, uint8_t* out);
+	static inline void widen_sse2(const uint32_t* in, unsigned int width, unsigned int factor, uint32_t* out);
+	static inline void map_sse2(const uint8_t* in, size_t count, const uint32_t* palette, uint32_t* out);
+	static inline void scale2x_sse2(const uint8_t* padded, unsigned int width, unsigned int height, uint8_t* out);
+	static inline void scale3x_sse2(const uint8_t* padded, unsigned int width, unsigned int height, uint8_t* out);
+
+	CHIP8_TARGET_AVX2 static inline void unpack_avx2(const uint64_t* rows, size_t words, uint8_t* out);
+	CHIP8_TARGET_AVX2 static inline void widen_avx2(const uint8_t* in, unsigned int width, unsigned int factor, uint8_t* out);
+	CHIP8_TARGET_AVX2 static inline void widen_avx2(const uint32_t* in, unsigned int width, unsigned int factor, uint32_t* out);
+	CHIP8_TARGET_AVX2 static inline void map_avx2(const uint8_t* in, size_t count, const uint32_t* palette, unsigned int palette_size, uint32_t* out);
+#endif
+};
+
+Scaler::Scaler()
+{
+#if defined(CHIP8_SCALER_X64)
+	// SSE2 is part of x86-64
+	_detected = ISA_SSE2;
+#if defined(__GNUC__)
+	if (__builtin_cpu_supports("avx2"))
+		_detected = ISA_AVX2;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	bool os_saves_ymm = (info[2] & (1 << 27)) && (_xgetbv(0) & 0x6) == 0x6;
+	__cpuidex(info, 7, 0);
+	if (os_saves_ymm && (info[1] & (1 << 5)))
+		_detected = ISA_AVX2;
+#endif
+#endif
+	_isa = _detected;
+}
+
+void Scaler::unpack(const uint64_t* rows, unsigned int width, unsigned int height, uint8_t* out) const
+{
+	size_t words = static_cast<size_t>(width / 64) * height;
+
+#if defined(CHIP8_SCALER_X64)
+	if (_isa == ISA_AVX2)
+		return unpack_avx2(rows, words, out);
+	if (_isa == ISA_SSE2)
+		return unpack_sse2(rows, words, out);
+#endif
+	for (size_t i = 0; i < words; ++i) {
+		for (unsigned int bit = 0; bit < 64; ++bit)
+			out[i * 64 + bit] = (rows[i] >> (63 - bit)) & 1u;
+	}
+}
+
+void Scaler::nearest(const uint8_t* in, unsigned int width, unsigned int height, unsigned int factor, uint8_t* out) const
+{
+	size_t pitch = static_cast<size_t>(width) * factor;
+
+	// Widen each row once, then copy it down
+	for (unsigned int y = 0; y < height; ++y) {
+		uint8_t* row = &out[y * factor * pitch];
+		widen(&in[y * width], width, factor, row);
+		for (unsigned int i = 1; i < factor; ++i)
+			memcpy(&row[i * pitch], row, pitch);
+	}
+}
+
+// EPX: each pixel becomes 2x2, corners take a neighbour's colour where two
+// adjacent neighbours agree, which rounds off diagonal staircases
+void Scaler::scale2x(const uint8_t* in, unsigned int width, unsigned int height, uint8_t* out) const
+{
+	const uint8_t* padded = pad(in, width, height);
+	size_t stride = width + 2;
+	ptrdiff_t s = static_cast<ptrdiff_t>(stride);
+
+#if defined(CHIP8_SCALER_X64)
+	if (_isa != ISA_SCALAR)
+		return scale2x_sse2(padded, width, height, out);
+#endif
+	for (unsigned int y = 0; y < height; ++y) {
+		const uint8_t* row = &padded[(y + 1) * stride + 1];
+		uint8_t* top = &out[(2 * y) * (2 * width)];
+		uint8_t* bottom = top + 2 * width;
+
+		for (unsigned int x = 0; x < width; ++x) {
+			const uint8_t* n = &row[x];
+			uint8_t p = n[0], a = n[-s], b = n[1], c = n[-1], d = n[s];
+			top[2 * x]        = (c == a && c != d && a != b) ? a : p;
+			top[2 * x + 1]    = (a == b && a != c && b != d) ? b : p;
+			bottom[2 * x]     = (d == c && d != b && c != a) ? c : p;
+			bottom[2 * x + 1] = (b == d && b != a && d != c) ? d : p;
+		}
+	}
+}
+
+void Scaler::scale3x(const uint8_t* in, unsigned int width, unsigned int height, uint8_t* out) const
+{
+	const uint8_t* padded = pad(in, width, height);
+	size_t stride = width + 2;
+	ptrdiff_t s = static_cast<ptrdiff_t>(stride);
+
+#if defined(CHIP8_SCALER_X64)
+	if (_isa != ISA_SCALAR)
+		return scale3x_sse2(padded, width, height, out);
+#endif
+	size_t pitch = 3 * static_cast<size_t>(width);
+	for (unsigned int y = 0; y < height; ++y) {
+		const uint8_t* row = &padded[(y + 1) * stride + 1];
+		uint8_t* o = &out[(3 * y) * pitch];
+
+		for (unsigned int x = 0; x < width; ++x) {
+			// A B C
+			// D E F
+			// G H I
+			const uint8_t* n = &row[x];
+			uint8_t a = n[-s - 1], b = n[-s], c = n[-s + 1];
+			uint8_t d = n[-1], e = n[0], f = n[1];
+			uint8_t g = n[s - 1], h = n[s], i = n[s + 1];
+			bool db = d == b && b != f && d != h;
+			bool bf = b == f && b != d && f != h;
+			bool dh = d == h && d != b && h != f;
+			bool hf = h == f && d != h && b != f;
+
+			uint8_t* p = &o[3 * x];
+			p[0]             = db ? d : e;
+			p[1]             = (db && e != c) || (bf && e != a) ? b : e;
+			p[2]             = bf ? f : e;
+			p[pitch]         = (db && e != g) || (dh && e != a) ? d : e;
+			p[pitch + 1]     = e;
+			p[pitch + 2]     = (bf && e != i) || (hf && e != c) ? f : e;
+			p[2 * pitch]     = dh ? d : e;
+			p[2 * pitch + 1] = (dh && e != i) || (hf && e != g) ? h : e;
+			p[2 * pitch + 2] = hf ? f : e;
+		}
+	}
+}
+
+void Scaler::map(const uint8_t* in, size_t count, const uint32_t* palette, unsigned int palette_size, uint32_t* out) const
+{
+#if defined(CHIP8_SCALER_X64)
+	if (_isa == ISA_AVX2 && palette_size <= 8)
+		return map_avx2(in, count, palette, palette_size, out);
+	if (_isa != ISA_SCALAR && palette_size == 2)
+		return map_sse2(in, count, palette, out);
+#endif
+	for (size_t i = 0; i < count; ++i)
+		out[i] = palette[in[i] < palette_size ? in[i] : 0];
+}
+
+bool Scaler::upscale(const uint8_t* in, unsigned int width, unsigned int height, Filter filter, unsigned int factor, uint8_t* out) const
+{
+	unsigned int step = filter == FILTER_SCALE2X ? 2 : filter == FILTER_SCALE3X ? 3 : 1;
+	if (factor == 0 || factor % step != 0)
+		return false;
+
+	if (step == 1) {
+		nearest(in, width, height, factor, out);
+		return true;
+	}
+	if (factor == step) {
+		step == 2 ? scale2x(in, width, height, out) : scale3x(in, width, height, out);
+		return true;
+	}
+
+	std::vector<uint8_t> smoothed(static_cast<size_t>(width) * height * step * step);
+	step == 2 ? scale2x(in, width, height, smoothed.data()) : scale3x(in, width, height, smoothed.data());
+	nearest(smoothed.data(), width * step, height * step, factor / step, out);
+	return true;
+}
+
+void Scaler::render(const uint64_t* rows, unsigned int width, unsigned int height, unsigned int factor,
+	const uint32_t palette[2], uint32_t* out) const
+{
+	size_t pitch = static_cast<size_t>(width) * factor;
+	_indices.resize(width);
+	_colors.resize(width);
+
+	for (unsigned int y = 0; y < height; ++y) {
+		uint32_t* row = &out[y * factor * pitch];
+		unpack(&rows[y * (width / 64)], width, 1, _indices.data());
+		map(_indices.data(), width, palette, 2, _colors.data());
+		widen(_colors.data(), width, factor, row);
+		for (unsigned int i = 1; i < factor; ++i)
+			memcpy(&row[i * pitch], row, pitch * sizeof(uint32_t));
+	}
+}
+
+template <typename T>
+void Scaler::widen_scalar(const T* in, unsigned int width, unsigned int factor, T* out)
+{
+	for (unsigned int x = 0; x < width; ++x)
+		std::fill_n(&out[x * factor], factor, in[x]);
+}
+
+void Scaler::widen(const uint8_t* in, unsigned int width, unsigned int factor, uint8_t* out) const
+{
+#if defined(CHIP8_SCALER_X64)
+	if (_isa == ISA_AVX2)
+		return widen_avx2(in, width, factor, out);
+	if (_isa == ISA_SSE2)
+		return widen_sse2(in, width, factor, out);
+#endif
+	widen_scalar(in, width, factor, out);
+}
+
+void Scaler::widen(const uint32_t* in, unsigned int width, unsigned int factor, uint32_t* out) const
+{
+#if defined(CHIP8_SCALER_X64)
+	if (_isa == ISA_AVX2)
+		return widen_avx2(in, width, factor, out);
+	if (_isa == ISA_SSE2)
+		return widen_sse2(in, width, factor, out);
+#endif
+	widen_scalar(in, width, factor, out);
+}
+
+// Copies the image into scratch with a one pixel border repeating the edge,
+// plus slack on the right so vector loads can run past the last column
+const uint8_t* Scaler::pad(const uint8_t* in, unsigned int width, unsigned int height) const
+{
+	size_t stride = width + 2;
+	_padded.assign(stride * (height + 2) + 32, 0);
+
+	for (unsigned int y = 0; y < height + 2; ++y) {
+		const uint8_t* src = &in[std::min(std::max(static_cast<int>(y) - 1, 0), static_cast<int>(height) - 1) * width];
+		uint8_t* dst = &_padded[y * stride];
+		dst[0] = src[0];
+		memcpy(&dst[1], src, width);
+		dst[width + 1] = src[width - 1];
+	}
+	return _padded.data();
+}
+
+#if defined(CHIP8_SCALER_X64)
+
+// Each source byte is broadcast across eight lanes, then every lane keeps its own bit
+void Scaler::unpack_sse2(const uint64_t* rows, size_t words, uint8_t* out)
+{
+	const __m128i bits = _mm_set1_epi64x(0x0102040810204080ll);
+	const __m128i one = _mm_set1_epi8(1);
+	const uint64_t spread = 0x0101010101010101ull;
+
+	for (size_t i = 0; i < words; ++i) {
+		for (int shift = 56; shift >= 0; shift -= 16) {
+			__m128i v = _mm_set_epi64x(static_cast<long long>(((rows[i] >> (shift - 8)) & 0xFF) * spread),
+				static_cast<long long>(((rows[i] >> shift) & 0xFF) * spread));
+			v = _mm_cmpeq_epi8(_mm_and_si128(v, bits), bits);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_and_si128(v, one));
+			out += 16;
+		}
+	}
+}
+
+// Stores a full vector of the pixel at each step and lets the next pixel
+// overwrite the excess. The last few pixels of a row fall back to scalar
+// so nothing is written past the end.
+void Scaler::widen_sse2(const uint8_t* in, unsigned int width, unsigned int factor, uint8_t* out)
+{
+	unsigned int x = 0;
+	for (; x < width && x * factor + std::max(factor, 16u) <= width * factor && factor <= 16; ++x)
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&out[x * factor]), _mm_set1_epi8(static_cast<char>(in[x])));
+
+	for (; x < width && factor > 16; ++x) {
+		__m128i v = _mm_set1_epi8(static_cast<char>(in[x]));
+		uint8_t* p = &out[x * factor];
+		for (unsigned int i = 0; i + 16 <= factor; i += 16)
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(&p[i]), v);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&p[factor - 16]), v);
+	}
+	widen_scalar(&in[x], width - x, factor, &out[x * factor]);
+}
+
+void Scaler::widen_sse2(const uint32_t* in, unsigned int width, unsigned int factor, uint32_t* out)
+{
+	if (factor < 4)
+		return widen_scalar(in, width, factor, out);
+
+	for (unsigned int x = 0; x < width; ++x) {
+		__m128i v = _mm_set1_epi32(static_cast<int>(in[x]));
+		uint32_t* p = &out[x * factor];
+		for (unsigned int i = 0; i + 4 <= factor; i += 4)
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(&p[i]), v);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&p[factor - 4]), v);
+	}
+}
+
+void Scaler::map_sse2(const uint8_t* in, size_t count, const uint32_t* palette, uint32_t* out)
+{
+	const __m128i off = _mm_set1_epi32(static_cast<int>(palette[0]));
+	const __m128i on = _mm_set1_epi32(static_cast<int>(palette[1]));
+	const __m128i one = _mm_set1_epi32(1);
+	const __m128i zero = _mm_setzero_si128();
+
+	size_t i = 0;
+	for (; i + 16 <= count; i += 16) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&in[i]));
+		__m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+		__m128i words[4] = {
+			_mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+			_mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero),
+		};
+		for (int j = 0; j < 4; ++j) {
+			// Out of range indices map to palette[0], like the scalar version
+			__m128i is_on = _mm_cmpeq_epi32(words[j], one);
+			__m128i color = _mm_or_si128(_mm_and_si128(is_on, on), _mm_andnot_si128(is_on, off));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(&out[i + 4 * j]), color);
+		}
+	}
+	for (; i < count; ++i)
+		out[i] = palette[in[i] == 1 ? 1 : 0];
+}
+
+// Vector blend: mask ? a : b
+static inline __m128i scaler_select(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static inline __m128i scaler_ne(__m128i a, __m128i b)
+{
+	return _mm_xor_si128(_mm_cmpeq_epi8(a, b), _mm_set1_epi8(-1));
+}
+
+// Sixteen pixels at a time, then the two output rows are interleaved with unpack
+void Scaler::scale2x_sse2(const uint8_t* padded, unsigned int width, unsigned int height, uint8_t* out)
+{
+	size_t stride = width + 2;
+	ptrdiff_t s = static_cast<ptrdiff_t>(stride);
+
+	for (unsigned int y = 0; y < height; ++y) {
+		const uint8_t* row = &padded[(y + 1) * stride + 1];
+		uint8_t* top = &out[(2 * y) * (2 * width)];
+		uint8_t* bottom = top + 2 * width;
+
+		unsigned int x = 0;
+		for (; x + 16 <= width; x += 16) {
+			auto load = [&](ptrdiff_t offset) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(&row[x] + offset)); };
+			__m128i p = load(0), a = load(-s), b = load(1), c = load(-1), d = load(s);
+
+			__m128i e0 = scaler_select(_mm_and_si128(_mm_cmpeq_epi8(c, a), _mm_and_si128(scaler_ne(c, d), scaler_ne(a, b))), a, p);
+			__m128i e1 = scaler_select(_mm_and_si128(_mm_cmpeq_epi8(a, b), _mm_and_si128(scaler_ne(a, c), scaler_ne(b, d))), b, p);
+			__m128i e2 = scaler_select(_mm_and_si128(_mm_cmpeq_epi8(d, c), _mm_and_si128(scaler_ne(d, b), scaler_ne(c, a))), c, p);
+			__m128i e3 = scaler_select(_mm_and_si128(_mm_cmpeq_epi8(b, d), _mm_and_si128(scaler_ne(b, a), scaler_ne(d, c))), d, p);
+
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(&top[2 * x]), _mm_unpacklo_epi8(e0, e1));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(&top[2 * x + 16]), _mm_unpackhi_epi8(e0, e1));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(&bottom[2 * x]), _mm_unpacklo_epi8(e2, e3));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(&bottom[2 * x + 16]), _mm_unpackhi_epi8(e2, e3));
+		}
+		for (; x < width; ++x) {
+			const uint8_t* n = &row[x];
+			uint8_t p = n[0], a = n[-s], b = n[1], c = n[-1], d = n[s];
+			top[2 * x]        = (c == a && c != d && a != b) ? a : p;
+			top[2 * x + 1]    = (a == b && a != c && b != d) ? b : p;
+			bottom[2 * x]     = (d == c && d != b && c != a) ? c : p;
+			bottom[2 * x + 1] = (b == d && b != a && d != c) ? d : p;
+		}
+	}
+}
+
+// The nine outputs are computed sixteen pixels at a time. SSE2 has no byte
+// shuffle for the three-way interleave, so that part goes through a buffer.
+void Scaler::scale3x_sse2(const uint8_t* padded, unsigned int width, unsigned int height, uint8_t* out)
+{
+	size_t stride = width + 2;
+	ptrdiff_t s = static_cast<ptrdiff_t>(stride);
+	size_t pitch = 3 * static_cast<size_t>(width);
+
+	for (unsigned int y = 0; y < height; ++y) {
+		const uint8_t* row = &padded[(y + 1) * stride + 1];
+		uint8_t* o = &out[(3 * y) * pitch];
+
+		for (unsigned int x = 0; x < width; x += 16) {
+			auto load = [&](ptrdiff_t offset) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(&row[x] + offset)); };
+			__m128i a = load(-s - 1), b = load(-s), c = load(-s + 1);
+			__m128i d = load(-1), e = load(0), f = load(1);
+			__m128i g = load(s - 1), h = load(s), i = load(s + 1);
+
+			__m128i db = _mm_and_si128(_mm_cmpeq_epi8(d, b), _mm_and_si128(scaler_ne(b, f), scaler_ne(d, h)));
+			__m128i bf = _mm_and_si128(_mm_cmpeq_epi8(b, f), _mm_and_si128(scaler_ne(b, d), scaler_ne(f, h)));
+			__m128i dh = _mm_and_si128(_mm_cmpeq_epi8(d, h), _mm_and_si128(scaler_ne(d, b), scaler_ne(h, f)));
+			__m128i hf = _mm_and_si128(_mm_cmpeq_epi8(h, f), _mm_and_si128(scaler_ne(d, h), scaler_ne(b, f)));
+
+			alignas(16) uint8_t q[9][16];
+			auto store = [&](int n, __m128i v) { _mm_store_si128(reinterpret_cast<__m128i*>(q[n]), v); };
+			store(0, scaler_select(db, d, e));
+			store(1, scaler_select(_mm_or_si128(_mm_and_si128(db, scaler_ne(e, c)), _mm_and_si128(bf, scaler_ne(e, a))), b, e));
+			store(2, scaler_select(bf, f, e));
+			store(3, scaler_select(_mm_or_si128(_mm_and_si128(db, scaler_ne(e, g)), _mm_and_si128(dh, scaler_ne(e, a))), d, e));
+			store(4, e);
+			store(5, scaler_select(_mm_or_si128(_mm_and_si128(bf, scaler_ne(e, i)), _mm_and_si128(hf, scaler_ne(e, c))), f, e));
+			store(6, scaler_select(dh, d, e));
+			store(7, scaler_select(_mm_or_si128(_mm_and_si128(dh, scaler_ne(e, i)), _mm_and_si128(hf, scaler_ne(e, g))), h, e));
+			store(8, scaler_select(hf, f, e));
+
+			unsigned int count = std::min(16u, width - x);
+			for (unsigned int k = 0; k < count; ++k) {
+				uint8_t* p = &o[3 * (x + k)];
+				for (int r = 0; r < 3; ++r) {
+					p[r * pitch] = q[3 * r][k];
+					p[r * pitch + 1] = q[3 * r + 1][k];
+					p[r * pitch + 2] = q[3 * r + 2][k];
+				}
+			}
+		}
+	}
+}
+
+CHIP8_TARGET_AVX2 void Scaler::unpack_avx2(const uint64_t* rows, size_t words, uint8_t* out)
+{
+	const __m256i bits = _mm256_set1_epi64x(0x0102040810204080ll);
+	const __m256i one = _mm256_set1_epi8(1);
+	const uint64_t spread = 0x0101010101010101ull;
+
+	for (size_t i = 0; i < words; ++i) {
+		for (int shift = 56; shift >= 0; shift -= 32) {
+			__m256i v = _mm256_set_epi64x(
+				static_cast<long long>(((rows[i] >> (shift - 24)) & 0xFF) * spread),
+				static_cast<long long>(((rows[i] >> (shift - 16)) & 0xFF) * spread),
+				static_cast<long long>(((rows[i] >> (shift - 8)) & 0xFF) * spread),
+				static_cast<long long>(((rows[i] >> shift) & 0xFF) * spread));
+			v = _mm256_cmpeq_epi8(_mm256_and_si256(v, bits), bits);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_and_si256(v, one));
+			out += 32;
+		}
+	}
+}
+
+CHIP8_TARGET_AVX2 void Scaler::widen_avx2(const uint8_t* in, unsigned int width, unsigned int factor, uint8_t* out)
+{
+	if (factor < 16)
+		return widen_sse2(in, width, factor, out);
+
+	for (unsigned int x = 0; x < width; ++x) {
+		__m256i v = _mm256_set1_epi8(static_cast<char>(in[x]));
+		uint8_t* p = &out[x * factor];
+		if (factor >= 32) {
+			for (unsigned int i = 0; i + 32 <= factor; i += 32)
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(&p[i]), v);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(&p[factor - 32]), v);
+		}
+		else {
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(p), _mm256_castsi256_si128(v));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(&p[factor - 16]), _mm256_castsi256_si128(v));
+		}
+	}
+}
+
+CHIP8_TARGET_AVX2 void Scaler::widen_avx2(const uint32_t* in, unsigned int width, unsigned int factor, uint32_t* out)
+{
+	if (factor < 8)
+		return widen_sse2(in, width, factor, out);
+
+	for (unsigned int x = 0; x < width; ++x) {
+		__m256i v = _mm256_set1_epi32(static_cast<int>(in[x]));
+		uint32_t* p = &out[x * factor];
+		for (unsigned int i = 0; i + 8 <= factor; i += 8)
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(&p[i]), v);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(&p[factor - 8]), v);
+	}
+}
+
+// Up to eight colours fit in one register, permutevar picks them by index
+CHIP8_TARGET_AVX2 void Scaler::map_avx2(const uint8_t* in, size_t count, const uint32_t* palette, unsigned int palette_size, uint32_t* out)
+{
+	alignas(32) uint32_t table[8] = { 0 };
+	for (unsigned int i = 0; i < palette_size; ++i)
+		table[i] = palette[i];
+	for (unsigned int i = palette_size; i < 8; ++i)
+		table[i] = palette[0];
+	const __m256i colors = _mm256_load_si256(reinterpret_cast<const __m256i*>(table));
+	const __m256i limit = _mm256_set1_epi32(static_cast<int>(palette_size));
+
+	size_t i = 0;
+	for (; i + 8 <= count; i += 8) {
+		__m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&in[i])));
+		// Out of range indices map to palette[0], like the scalar version
+		index = _mm256_and_si256(index, _mm256_cmpgt_epi32(limit, index));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(&out[i]), _mm256_permutevar8x32_epi32(colors, index));
+	}
+	for (; i < count; ++i)
+		out[i] = palette[in[i] < palette_size ? in[i] : 0];
+}
+
+#endif // CHIP8_SCALER_X64
+
+#endif // !SCALER_H
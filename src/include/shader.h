@@ -2,63 +2,80 @@
 #define SHADER_H
 
 #include <glad/glad.h>
+#include <GLFW/glfw3.h>
 
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <iterator>
+#include <unordered_map>
+#include <vector>
+
+// Program binaries are core in GL 4.1, the loader only covers 3.3
+#ifndef GL_PROGRAM_BINARY_RETRIEVABLE_HINT
+#define GL_PROGRAM_BINARY_RETRIEVABLE_HINT 0x8257
+#define GL_PROGRAM_BINARY_LENGTH 0x8741
+#define GL_NUM_PROGRAM_BINARY_FORMATS 0x87FE
+#endif
+
+typedef void (APIENTRYP PFN_GET_PROGRAM_BINARY)(GLuint, GLsizei, GLsizei*, GLenum*, void*);
+typedef void (APIENTRYP PFN_PROGRAM_BINARY)(GLuint, GLenum, const void*, GLsizei);
+typedef void (APIENTRYP PFN_PROGRAM_PARAMETERI)(GLuint, GLenum, GLint);
 
 class Shader
 {
 public:
 	unsigned ID;
 
-	Shader(const char* vertex_path, const char* fragment_path) {
-		std::string vertex_code;
-		std::string fragment_code;
-		std::ifstream v_shader_file;
-		std::ifstream f_shader_file;
-
-		v_shader_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-		f_shader_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-		try {
-			v_shader_file.open(vertex_path);
-			f_shader_file.open(fragment_path);
-			std::stringstream v_shaderstream, f_shaderstream;
-			v_shaderstream << v_shader_file.rdbuf();
-			f_shaderstream << f_shader_file.rdbuf();
-
-			vertex_code = v_shaderstream.str();
-			fragment_code = f_shaderstream.str();
-		}
-		catch (std::ifstream::failure& e) {
-			std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ: " << e.what() << std::endl;
-		}
-		const char* v_shader_code = vertex_code.c_str();
-		const char* f_shader_code = fragment_code.c_str();
+	// Builds a program from GLSL sources. With a cache directory, a program
+	// linked by an earlier run with the same sources and driver is loaded
+	// from there instead of being compiled again.
+	Shader(const char* vertex_code, const char* fragment_code, const std::string& cache_dir = "") {
+		std::string cache_path;
+		if (!cache_dir.empty() && binary_supported())
+			cache_path = cache_dir + "/program_" + to_hex(cache_key(vertex_code, fragment_code)) + ".bin";
+
+		ID = glCreateProgram();
+		if (!cache_path.empty() && load_binary(cache_path))
+			return;
 
 		unsigned int vertex, fragment;
 		// Vertex shader
 		vertex = glCreateShader(GL_VERTEX_SHADER);
-		glShaderSource(vertex, 1, &v_shader_code, NULL);
+		glShaderSource(vertex, 1, &vertex_code, NULL);
 		glCompileShader(vertex);
 		check_compile_errors(vertex, "VERTEX");
 		// Fragment shader
 		fragment = glCreateShader(GL_FRAGMENT_SHADER);
-		glShaderSource(fragment, 1, &f_shader_code, NULL);
+		glShaderSource(fragment, 1, &fragment_code, NULL);
 		glCompileShader(fragment);
 		check_compile_errors(fragment, "FRAGMENT");
 		// Shader Program
-		ID = glCreateProgram();
 		glAttachShader(ID, vertex);
 		glAttachShader(ID, fragment);
+		if (!cache_path.empty())
+			_program_parameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 		glLinkProgram(ID);
 		check_compile_errors(ID, "PROGRAM");
 
 		glDeleteShader(vertex);
 		glDeleteShader(fragment);
+
+		if (!cache_path.empty())
+			save_binary(cache_path);
 	}
 
+	// Reads a shader source file, for overriding the embedded sources
+	static inline bool read_file(const char* path, std::string& code);
+
+	// Per-user cache directory, empty if there is nowhere sensible to put one
+	static inline std::string default_cache_dir();
+
 	inline void use() const;
 
 	inline void set_bool(const std::string& name, bool value) const;
@@ -67,8 +84,24 @@ public:
 
 	inline void set_float(const std::string& name, float value) const;
 
+	inline void set_vec3(const std::string& name, float x, float y, float z) const;
+
 private:
-	void check_compile_errors(GLuint shader, std::string type);
+	// Uniform locations, looked up once per name
+	mutable std::unordered_map<std::string, GLint> _uniforms;
+
+	PFN_GET_PROGRAM_BINARY _get_program_binary{ nullptr };
+	PFN_PROGRAM_BINARY     _program_binary{ nullptr };
+	PFN_PROGRAM_PARAMETERI _program_parameteri{ nullptr };
+
+	inline GLint location(const std::string& name) const;
+
+	inline void check_compile_errors(GLuint shader, std::string type);
+	inline bool binary_supported();
+	inline bool load_binary(const std::string& path);
+	inline void save_binary(const std::string& path);
+	static inline uint64_t cache_key(const char* vertex_code, const char* fragment_code);
+	static inline std::string to_hex(uint64_t value);
 };
 
 // activate the shader
@@ -79,19 +112,32 @@ inline void Shader::use() const
 }
 // utility uniform functions
 // ------------------------------------------------------------------------
+inline GLint Shader::location(const std::string& name) const
+{
+    auto it = _uniforms.find(name);
+    if (it == _uniforms.end())
+        it = _uniforms.emplace(name, glGetUniformLocation(ID, name.c_str())).first;
+    return it->second;
+}
+// ------------------------------------------------------------------------
 inline void Shader::set_bool(const std::string& name, bool value) const
 {
-    glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+    glUniform1i(location(name), (int)value);
 }
 // ------------------------------------------------------------------------
 inline void Shader::set_int(const std::string& name, int value) const
 {
-    glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+    glUniform1i(location(name), value);
 }
 // ------------------------------------------------------------------------
 inline void Shader::set_float(const std::string& name, float value) const
 {
-    glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+    glUniform1f(location(name), value);
+}
+// ------------------------------------------------------------------------
+inline void Shader::set_vec3(const std::string& name, float x, float y, float z) const
+{
+    glUniform3f(location(name), x, y, z);
 }
 // ------------------------------------------------------------------------
 
@@ -119,4 +165,119 @@ void Shader::check_compile_errors(GLuint shader, std::string type)
 	}
 }
 
+bool Shader::read_file(const char* path, std::string& code)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open())
+		return false;
+
+	std::stringstream stream;
+	stream << file.rdbuf();
+	code = stream.str();
+	return true;
+}
+
+std::string Shader::default_cache_dir()
+{
+	if (const char* xdg = std::getenv("XDG_CACHE_HOME"))
+		return std::string(xdg) + "/chestnut";
+	if (const char* local = std::getenv("LOCALAPPDATA"))
+		return std::string(local) + "/chestnut";
+	if (const char* home = std::getenv("HOME"))
+		return std::string(home) + "/.cache/chestnut";
+	return "";
+}
+
+// Drivers without GL 4.1 or ARB_get_program_binary, or with no binary formats, always compile
+bool Shader::binary_supported()
+{
+	_get_program_binary = reinterpret_cast<PFN_GET_PROGRAM_BINARY>(glfwGetProcAddress("glGetProgramBinary"));
+	_program_binary = reinterpret_cast<PFN_PROGRAM_BINARY>(glfwGetProcAddress("glProgramBinary"));
+	_program_parameteri = reinterpret_cast<PFN_PROGRAM_PARAMETERI>(glfwGetProcAddress("glProgramParameteri"));
+	if (!_get_program_binary || !_program_binary || !_program_parameteri)
+		return false;
+
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	return formats > 0;
+}
+
+// Cache file: binary format, then the driver's program binary
+bool Shader::load_binary(const std::string& path)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open())
+		return false;
+
+	GLenum format = 0;
+	file.read(reinterpret_cast<char*>(&format), sizeof(format));
+	std::vector<char> binary((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if (!file.eof() || binary.empty())
+		return false;
+
+	// A driver update can reject an old binary even with the same version string
+	_program_binary(ID, format, binary.data(), static_cast<GLsizei>(binary.size()));
+	GLint success = GL_FALSE;
+	glGetProgramiv(ID, GL_LINK_STATUS, &success);
+	return success == GL_TRUE;
+}
+
+void Shader::save_binary(const std::string& path)
+{
+	GLint success = GL_FALSE, length = 0;
+	glGetProgramiv(ID, GL_LINK_STATUS, &success);
+	glGetProgramiv(ID, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (success != GL_TRUE || length <= 0)
+		return;
+
+	std::vector<char> binary(length);
+	GLenum format = 0;
+	_get_program_binary(ID, length, nullptr, &format, binary.data());
+
+	std::error_code error;
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+
+	// Written to a temporary name first, so a concurrent launch never reads half a file
+	std::string temporary = path + ".tmp";
+	{
+		std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+		if (!file.is_open())
+			return;
+		file.write(reinterpret_cast<const char*>(&format), sizeof(format));
+		file.write(binary.data(), binary.size());
+		if (!file.good())
+			return;
+	}
+	std::remove(path.c_str());
+	std::rename(temporary.c_str(), path.c_str());
+}
+
+// FNV-1a over the driver identification strings and both sources
+uint64_t Shader::cache_key(const char* vertex_code, const char* fragment_code)
+{
+	uint64_t hash = 0xCBF29CE484222325ull;
+	auto mix = [&](const char* text) {
+		for (; text && *text; ++text) {
+			hash ^= static_cast<uint8_t>(*text);
+			hash *= 0x100000001B3ull;
+		}
+		hash ^= 0xFF;
+		hash *= 0x100000001B3ull;
+	};
+
+	mix(reinterpret_cast<const char*>(glGetString(GL_VENDOR)));
+	mix(reinterpret_cast<const char*>(glGetString(GL_RENDERER)));
+	mix(reinterpret_cast<const char*>(glGetString(GL_VERSION)));
+	mix(vertex_code);
+	mix(fragment_code);
+	return hash;
+}
+
+std::string Shader::to_hex(uint64_t value)
+{
+	std::ostringstream out;
+	out << std::hex << value;
+	return out.str();
+}
+
 #endif // !SHADER_H
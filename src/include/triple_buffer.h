@@ -0,0 +1,50 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <atomic>
+#include <cstdint>
+
+// Single producer, single consumer handoff of the latest value, without locks.
+//
+// The writer fills back() and publishes it, the reader takes the newest
+// published value with update() and reads front(). Three slots mean neither
+// side ever waits: the third one sits in the middle, holding the last value
+// published. Values the reader never got round to are dropped.
+template <typename T>
+class TripleBuffer {
+public:
+	// Sets all three slots, before either side starts using the buffer
+	void reset(const T& value)
+	{
+		for (T& slot : _slots)
+			slot = value;
+		_back = 0;
+		_front = 1;
+		_middle.store(2, std::memory_order_relaxed);
+	}
+
+	// Writer side
+	T& back() { return _slots[_back]; }
+	void publish() { _back = _middle.exchange(_back | FRESH, std::memory_order_acq_rel) & INDEX; }
+
+	// Reader side. Returns false if nothing was published since the last call.
+	bool update()
+	{
+		if (!(_middle.load(std::memory_order_relaxed) & FRESH))
+			return false;
+		_front = _middle.exchange(_front, std::memory_order_acq_rel) & INDEX;
+		return true;
+	}
+	const T& front() const { return _slots[_front]; }
+
+private:
+	static const uint8_t INDEX = 0x3;
+	static const uint8_t FRESH = 0x4;	// middle slot holds a value the reader hasn't seen
+
+	T _slots[3]{};
+	uint8_t _back{ 0 };
+	uint8_t _front{ 1 };
+	std::atomic<uint8_t> _middle{ 2 };
+};
+
+#endif // !TRIPLE_BUFFER_H
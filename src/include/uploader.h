@@ -0,0 +1,179 @@
+#ifndef UPLOADER_H
+#define UPLOADER_H
+
+#include <glad/glad.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <vector>
+
+// Copies display rows into the RG32UI display atlas (see main.cpp), one
+// texel column per display.
+//
+// The direct path hands glTexSubImage2D client memory, which the driver has to
+// copy before the call returns. The PBO path alternates between two pixel
+// unpack buffers. The rows for frame N+1 go into one while the transfer for
+// frame N reads the other. A fence after each transfer stops the CPU from
+// writing a buffer the GPU hasn't finished with. A frame whose buffer can't be
+// mapped, or whose contents are lost on unmap, falls back to the direct path.
+class PixelUploader {
+public:
+	static const unsigned int BUFFER_COUNT = 2;
+	static const unsigned int ROW_BYTES = sizeof(uint64_t);
+
+	// `columns` displays of `rows` rows each
+	PixelUploader(bool use_pbo, unsigned int rows, unsigned int columns = 1)
+		: _use_pbo(use_pbo), _rows(rows)
+	{
+		if (!_use_pbo)
+			return;
+
+		glGenBuffers(BUFFER_COUNT, _buffers);
+		for (unsigned int i = 0; i < BUFFER_COUNT; ++i) {
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _buffers[i]);
+			glBufferData(GL_PIXEL_UNPACK_BUFFER, rows * columns * ROW_BYTES, nullptr, GL_STREAM_DRAW);
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+
+	PixelUploader(const PixelUploader&) = delete;
+	PixelUploader& operator=(const PixelUploader&) = delete;
+
+	// Frees the buffers, while the context is still current
+	inline void destroy();
+
+	// One frame's uploads go between begin() and end(), into the bound texture
+	inline void begin();
+	inline void end();
+
+	// Uploads `count` rows starting at `first` into texel column `column`.
+	// `rows` must stay unchanged until end().
+	inline void upload(const uint64_t* rows, unsigned int first, unsigned int count, unsigned int column = 0);
+
+	// Frame timing: time spent uploading, and the part of it spent waiting on a fence
+	uint64_t uploads() const { return _uploads; }
+	double upload_seconds() const { return _upload_seconds; }
+	double stall_seconds() const { return _stall_seconds; }
+	inline void report(std::ostream& out) const;
+
+private:
+	typedef std::chrono::steady_clock clock;
+
+	struct Region {
+		const uint64_t* rows;	// for the direct fallback
+		unsigned int column;
+		unsigned int first;
+		unsigned int count;
+	};
+
+	bool     _use_pbo;
+	unsigned int _rows;
+	GLuint   _buffers[BUFFER_COUNT]{ 0 };
+	GLsync   _fences[BUFFER_COUNT]{ nullptr };
+	unsigned int _next{ 0 };
+
+	// The frame in progress. With a PBO the transfers wait until it is unmapped.
+	uint8_t* _mapped{ nullptr };
+	std::vector<Region> _regions;
+	clock::time_point _start{};
+
+	uint64_t _uploads{ 0 };
+	double   _upload_seconds{ 0.0 };
+	double   _stall_seconds{ 0.0 };
+};
+
+inline void PixelUploader::destroy()
+{
+	if (!_use_pbo)
+		return;
+
+	for (unsigned int i = 0; i < BUFFER_COUNT; ++i) {
+		if (_fences[i])
+			glDeleteSync(_fences[i]);
+		_fences[i] = nullptr;
+	}
+	glDeleteBuffers(BUFFER_COUNT, _buffers);
+	_use_pbo = false;
+}
+
+inline void PixelUploader::begin()
+{
+	_start = clock::now();
+	if (!_use_pbo)
+		return;
+
+	unsigned int index = _next;
+
+	// Only blocks if the GPU is still reading this buffer from two frames back
+	if (_fences[index]) {
+		clock::time_point wait = clock::now();
+		glClientWaitSync(_fences[index], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+		glDeleteSync(_fences[index]);
+		_fences[index] = nullptr;
+		_stall_seconds += std::chrono::duration<double>(clock::now() - wait).count();
+	}
+
+	// The fence already guarantees the buffer is free, so skip the driver's own sync
+	GLint size = 0;
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _buffers[index]);
+	glGetBufferParameteriv(GL_PIXEL_UNPACK_BUFFER, GL_BUFFER_SIZE, &size);
+	_mapped = static_cast<uint8_t*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT));
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	_regions.clear();
+}
+
+inline void PixelUploader::upload(const uint64_t* rows, unsigned int first, unsigned int count, unsigned int column)
+{
+	if (!_use_pbo || !_mapped) {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, column, first, 1, count, GL_RG_INTEGER, GL_UNSIGNED_INT, &rows[first]);
+	}
+	else {
+		memcpy(&_mapped[(column * _rows + first) * ROW_BYTES], &rows[first], count * ROW_BYTES);
+		_regions.push_back(Region{ rows, column, first, count });
+	}
+}
+
+inline void PixelUploader::end()
+{
+	if (_use_pbo && _mapped) {
+		unsigned int index = _next;
+		_next = (_next + 1) % BUFFER_COUNT;
+
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _buffers[index]);
+		bool intact = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE;
+		_mapped = nullptr;
+
+		if (intact) {
+			for (const Region& region : _regions) {
+				GLintptr offset = (region.column * _rows + region.first) * ROW_BYTES;
+				glTexSubImage2D(GL_TEXTURE_2D, 0, region.column, region.first, 1, region.count,
+					GL_RG_INTEGER, GL_UNSIGNED_INT, reinterpret_cast<const void*>(offset));
+			}
+			_fences[index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		}
+		else {
+			// The buffer's contents were lost (e.g. a mode switch), send the rows again from client memory
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			for (const Region& region : _regions) {
+				glTexSubImage2D(GL_TEXTURE_2D, 0, region.column, region.first, 1, region.count,
+					GL_RG_INTEGER, GL_UNSIGNED_INT, &region.rows[region.first]);
+			}
+		}
+	}
+
+	++_uploads;
+	_upload_seconds += std::chrono::duration<double>(clock::now() - _start).count();
+}
+
+inline void PixelUploader::report(std::ostream& out) const
+{
+	double per_upload = _uploads ? 1e6 / _uploads : 0.0;
+	out << "upload (" << (_use_pbo ? "pbo" : "direct") << "): " << _uploads << " frames, "
+		<< _upload_seconds * per_upload << " us/frame, " << _stall_seconds * per_upload << " us/frame stalled" << std::endl;
+}
+
+#endif // !UPLOADER_H
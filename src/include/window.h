@@ -5,17 +5,16 @@
 #include <GLFW/glfw3.h>
 #include <iostream>
 
-#include <chip8.h>
-
-extern chip8 _cpu;
-
-void framebuffer_size_callback(GLFWwindow*, int, int);
-void key_callback(GLFWwindow*, int, int, int, int);
+#include <emulator_thread.h>
+#include <frame_pacer.h>
 
+// The GLFW window of one emulator. Callbacks get back to the emulator and
+// pacer it was created for through the window's user pointer.
 class WindowClass {
 public:
 	GLFWwindow* window;
-	WindowClass(int window_width, int window_height, const char* window_title)
+	WindowClass(int window_width, int window_height, const char* window_title, EmulatorThread& emulator, FramePacer& pacer)
+		: _emulator(emulator), _pacer(pacer)
 	{
 		glfwInit();
 		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
@@ -35,41 +34,78 @@ public:
 			exit(EXIT_FAILURE);
 		}
 		glViewport(0, 0, window_width, window_height);
+		glfwSetWindowUserPointer(window, this);
 		glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+		glfwSetWindowRefreshCallback(window, window_refresh_callback);
 		glfwSetKeyCallback(window, key_callback);
 	}
+
+	// The user pointer refers back to this object
+	WindowClass(const WindowClass&) = delete;
+	WindowClass& operator=(const WindowClass&) = delete;
+
+private:
+	EmulatorThread& _emulator;
+	FramePacer&     _pacer;
+
+	static WindowClass& from(GLFWwindow* window) { return *static_cast<WindowClass*>(glfwGetWindowUserPointer(window)); }
+
+	static inline void framebuffer_size_callback(GLFWwindow* window, int window_width, int window_height);
+	static inline void window_refresh_callback(GLFWwindow* window);
+	static inline void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
 };
 
-void framebuffer_size_callback(GLFWwindow* window, int window_width, int window_height)
+inline void WindowClass::framebuffer_size_callback(GLFWwindow* window, int window_width, int window_height)
 {
 	glViewport(0, 0, window_width, window_height);
+	from(window)._pacer.request_redraw();
 }
 
-void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
+// The window system lost the contents, e.g. after being uncovered
+inline void WindowClass::window_refresh_callback(GLFWwindow* window)
 {
+	from(window)._pacer.request_redraw();
+}
+
+// Keypad index for a host key, or -1 if it isn't mapped
+inline int keypad_index(int key)
+{
+	switch (key) {
+	case GLFW_KEY_X: return 0x0;
+	case GLFW_KEY_1: return 0x1;
+	case GLFW_KEY_2: return 0x2;
+	case GLFW_KEY_3: return 0x3;
+	case GLFW_KEY_Q: return 0x4;
+	case GLFW_KEY_W: return 0x5;
+	case GLFW_KEY_E: return 0x6;
+	case GLFW_KEY_A: return 0x7;
+	case GLFW_KEY_S: return 0x8;
+	case GLFW_KEY_D: return 0x9;
+	case GLFW_KEY_Z: return 0xA;
+	case GLFW_KEY_C: return 0xB;
+	case GLFW_KEY_4: return 0xC;
+	case GLFW_KEY_R: return 0xD;
+	case GLFW_KEY_F: return 0xE;
+	case GLFW_KEY_V: return 0xF;
+	}
+	return -1;
+}
+
+inline void WindowClass::key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	EmulatorThread& emulator = from(window)._emulator;
+	int index = keypad_index(key);
+
 	switch (action) {
 	case GLFW_PRESS:
-		switch (key) {
-		case GLFW_KEY_ESCAPE: glfwSetWindowShouldClose(window, true);	  break;
-		case GLFW_KEY_X: _cpu._keypad[0] = 1;							  break;
-		case GLFW_KEY_1: _cpu._keypad[1] = 1;							  break;
-		case GLFW_KEY_2: _cpu._keypad[2] = 1;							  break;
-		case GLFW_KEY_3: _cpu._keypad[3] = 1;							  break;
-		case GLFW_KEY_Q: _cpu._keypad[4] = 1;							  break;
-		case GLFW_KEY_W: _cpu._keypad[5] = 1;							  break;
-		case GLFW_KEY_E: _cpu._keypad[6] = 1;							  break;
-		case GLFW_KEY_A: _cpu._keypad[7] = 1;							  break;
-		case GLFW_KEY_S: _cpu._keypad[8] = 1;							  break;
-		case GLFW_KEY_D: _cpu._keypad[9] = 1;							  break;
-		case GLFW_KEY_Z: _cpu._keypad[0xA] = 1;							  break;
-		case GLFW_KEY_C: _cpu._keypad[0xB] = 1;							  break;
-		case GLFW_KEY_4: _cpu._keypad[0xC] = 1;							  break;
-		case GLFW_KEY_R: _cpu._keypad[0xD] = 1;							  break;
-		case GLFW_KEY_F: _cpu._keypad[0xE] = 1;							  break;
-		case GLFW_KEY_V: _cpu._keypad[0xF] = 1;							  break;
-		}
+		if (key == GLFW_KEY_ESCAPE)
+			glfwSetWindowShouldClose(window, true);
+		else if (index >= 0)
+			emulator.set_key(static_cast<uint8_t>(index), true);
 		break;
-	case GLFW_RELEASE: memset(_cpu._keypad, 0, sizeof(_cpu._keypad));
+	case GLFW_RELEASE:
+		if (index >= 0)
+			emulator.set_key(static_cast<uint8_t>(index), false);
 		break;
 	}
 }
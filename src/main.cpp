@@ -1,14 +1,18 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
-#include <thread>
+#include <memory>
+#include <vector>
 
 #include <chip8.h>
+#include <emulator_thread.h>
+#include <frame_pacer.h>
+#include <recorder.h>
 #include <window.h>
 #include <shader.h>
-
-#define FRAME_INTERVAL 1.0f / 60
-#define MULTIPLIER 4
-
-chip8 _cpu;
+#include <shader_sources.h>
+#include <uploader.h>
 
 const unsigned int WINDOW_WIDTH = 640;
 const unsigned int WINDOW_HEIGHT = 320;
@@ -16,18 +20,73 @@ const char *WINDOW_TITLE = "CHIP8 emu";
 
 int main(int argc, char* argv[])
 {
-	if (argc != 2) {
-		std::cerr << "Usage: <ROM>" << std::endl;
+	if (argc < 2 || argc > 11) {
+		std::cerr << "Usage: <ROM> [instructions per second|vip] [pbo] [novsync] [record FILE] [shaders DIR] [wall N]" << std::endl;
 		std::exit(EXIT_FAILURE);
 	}
 
 	char const* rom_file_name = argv[1];
 
-	_cpu.load_rom(rom_file_name);
+	EmulatorThread emulator;
+	FramePacer pacer(1.0 / TIMER_FREQUENCY);
+
+	bool vip = false;
+	uint32_t speed = DEFAULT_INSTRUCTIONS_PER_SECOND;
+	unsigned int instances = 1;
+	bool use_pbo = false;
+	bool vsync = true;
+	Recorder recorder;
+	const char* shader_dir = nullptr;
+	for (int i = 2; i < argc; ++i) {
+		if (strcmp(argv[i], "vip") == 0)
+			vip = true;
+		else if (strcmp(argv[i], "pbo") == 0)
+			use_pbo = true;
+		else if (strcmp(argv[i], "novsync") == 0)
+			vsync = false;
+		else if (strcmp(argv[i], "record") == 0 && i + 1 < argc) {
+			if (!recorder.open(argv[++i])) {
+				std::cerr << "Failed to write " << argv[i] << std::endl;
+				std::exit(EXIT_FAILURE);
+			}
+			emulator.set_recorder(&recorder);
+		}
+		else if (strcmp(argv[i], "shaders") == 0 && i + 1 < argc)
+			shader_dir = argv[++i];
+		else if (strcmp(argv[i], "wall") == 0 && i + 1 < argc)
+			instances = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+		else
+			speed = static_cast<uint32_t>(std::strtoul(argv[i], nullptr, 10));
+	}
+
+	// With `wall N`, N copies of the ROM run side by side for monitoring
+	std::vector<std::unique_ptr<chip8>> cpus;
+	for (unsigned int i = 0; i < instances; ++i) {
+		cpus.push_back(std::make_unique<chip8>());
+		cpus.back()->load_rom(rom_file_name);
+		if (vip)
+			cpus.back()->set_vip_timing();
+		else
+			cpus.back()->set_speed(speed);
+		emulator.add(*cpus.back());
+	}
 
-	WindowClass window(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE);
+	WindowClass window(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, emulator, pacer);
+	pacer.set_vsync(vsync);
+
+	// The sources built into the binary, unless a directory of edited ones is given
+	std::string vertex_code = VERTEX_SHADER_SOURCE;
+	std::string fragment_code = FRAGMENT_SHADER_SOURCE;
+	if (shader_dir) {
+		std::string dir = shader_dir;
+		if (!Shader::read_file((dir + "/vertex_shader.glsl").c_str(), vertex_code) ||
+			!Shader::read_file((dir + "/fragment_shader.glsl").c_str(), fragment_code)) {
+			std::cerr << "Failed to read shaders from " << dir << std::endl;
+			std::exit(EXIT_FAILURE);
+		}
+	}
 
-	Shader shader("shaders/vertex_shader.glsl", "shaders/fragment_shader.glsl");
+	Shader shader(vertex_code.c_str(), fragment_code.c_str(), Shader::default_cache_dir());
 
 	float vertices[] = {
 		 1.0f,  1.0f, 0.0f,   1.0f, 1.0f, // top right
@@ -55,6 +114,29 @@ int main(int argc, char* argv[])
 	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
 	glEnableVertexAttribArray(1);
 
+	// One tile per instance in a grid, centre and half size in clip space.
+	// Instance i samples texel column i of the atlas.
+	unsigned int columns = static_cast<unsigned int>(std::ceil(std::sqrt(static_cast<double>(instances))));
+	unsigned int rows = (instances + columns - 1) / columns;
+	float margin = instances > 1 ? 0.96f : 1.0f;
+	std::vector<float> tiles;
+	for (unsigned int i = 0; i < instances; ++i) {
+		tiles.push_back(-1.0f + (2.0f * (i % columns) + 1.0f) / columns);
+		tiles.push_back(1.0f - (2.0f * (i / columns) + 1.0f) / rows);
+		tiles.push_back(margin / columns);
+		tiles.push_back(margin / rows);
+	}
+
+	unsigned int tile_VBO;
+	glGenBuffers(1, &tile_VBO);
+	glBindBuffer(GL_ARRAY_BUFFER, tile_VBO);
+	glBufferData(GL_ARRAY_BUFFER, tiles.size() * sizeof(float), tiles.data(), GL_STATIC_DRAW);
+
+	// tile attribute, advanced once per instance
+	glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+	glEnableVertexAttribArray(2);
+	glVertexAttribDivisor(2, 1);
+
 	unsigned int texture;
 	glGenTextures(1, &texture);
 	glBindTexture(GL_TEXTURE_2D, texture);
@@ -62,35 +144,104 @@ int main(int argc, char* argv[])
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+
+	// The packed displays as they are, one 64-bit row per RG32UI texel and one
+	// texel column per instance. The fragment shader picks out the bits, so a
+	// full upload is 256 bytes per display. Allocated once, frames only
+	// replace the rows that changed.
+	GLint max_size = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size);
+	if (instances > static_cast<unsigned int>(max_size)) {
+		std::cerr << "At most " << max_size << " instances fit in the display atlas" << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+	std::vector<uint64_t> shown(instances * 32, 0);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32UI, instances, 32, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, shown.data());
+
+	PixelUploader uploader(use_pbo, 32, instances);
 
-	double current_time, last_time = glfwGetTime();
+	shader.use();
+	shader.set_int("display", 0);
+	shader.set_vec3("foreground", 1.0f, 1.0f, 1.0f);
+	shader.set_vec3("background", 0.0f, 0.0f, 0.0f);
+
+	// From here on the cores belong to the emulation thread
+	emulator.set_publish_callback(glfwPostEmptyEvent);
+	emulator.start();
 
 	while (!glfwWindowShouldClose(window.window)) {
-		// Render loop
-		current_time = glfwGetTime();
-		
-		glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-		glClear(GL_COLOR_BUFFER_BIT);
-
-		if (current_time * MULTIPLIER - last_time >= FRAME_INTERVAL) {
-			last_time = current_time;
-			_cpu.cycle();
-			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 64, 32, 0, GL_RGBA, GL_UNSIGNED_BYTE, _cpu._video);
-			glGenerateMipmap(GL_TEXTURE_2D);
+		// Render loop. The emulation thread posts an empty event for every
+		// frame it publishes, which ends the wait.
+		pacer.wait();
+
+		// Frames can be skipped, so compare against what the texture holds.
+		// Each instance that changed gets one upload of its dirty rows.
+		if (emulator.update()) {
+			const uint64_t* displays = emulator.frame().displays.data();
+			bool began = false;
+
+			for (unsigned int i = 0; i < instances; ++i) {
+				const uint64_t* display = &displays[i * 32];
+				uint64_t* current = &shown[i * 32];
+
+				uint32_t dirty = 0;
+				for (unsigned int y = 0; y < 32; ++y) {
+					if (display[y] != current[y])
+						dirty |= 1u << y;
+				}
+				if (!dirty)
+					continue;
+				memcpy(current, display, 32 * sizeof(uint64_t));
+
+				unsigned int first = 0, last = 31;
+				while (!(dirty & (1u << first)))
+					++first;
+				while (!(dirty & (1u << last)))
+					--last;
+
+				if (!began) {
+					uploader.begin();
+					began = true;
+				}
+				// Red takes the low half of each row, which assumes a little-endian host
+				uploader.upload(current, first, last - first + 1, i);
+			}
+			if (began) {
+				uploader.end();
+				pacer.request_redraw();
+			}
+		}
+		if (!pacer.redraw_pending())
+			continue;
+
+		// A single quad covers the whole viewport, the wall has gaps between tiles
+		if (instances > 1) {
+			glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+			glClear(GL_COLOR_BUFFER_BIT);
 		}
 		shader.use();
 		glBindVertexArray(VAO);
 		glBindTexture(GL_TEXTURE_2D, texture);
-		glDrawArrays(GL_TRIANGLES, 0, 6);
+		glDrawArraysInstanced(GL_TRIANGLES, 0, 6, instances);
 
-		glfwSwapBuffers(window.window);
-		glfwPollEvents();
-		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		pacer.present(window.window);
 	}
+	emulator.stop();
+	if (recorder.is_open()) {
+		recorder.close();
+		recorder.report(std::cout);
+	}
+	uploader.report(std::cout);
+	pacer.report(std::cout);
+
 	glDeleteVertexArrays(1, &VAO);
 	glDeleteBuffers(1, &VBO);
+	glDeleteBuffers(1, &tile_VBO);
 	glDeleteTextures(1, &texture);
+	uploader.destroy();
 
 	glfwTerminate();
 }
\ No newline at end of file
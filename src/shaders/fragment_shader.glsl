@@ -2,10 +2,22 @@
 out vec4 FragColor;
 
 in vec2 TexCoord;
+flat in int Column;
 
-uniform sampler2D texture1;
+// One texel column per display and one texel per row, top row first. The
+// green channel holds x 0-31 and red x 32-63, most significant bit leftmost.
+uniform usampler2D display;
+uniform vec3 foreground;
+uniform vec3 background;
 
 void main()
 {
-	FragColor = texture(texture1, TexCoord);
+	int x = clamp(int(TexCoord.x * 64.0), 0, 63);
+	int y = clamp(int((1.0 - TexCoord.y) * 32.0), 0, 31);
+
+	uvec2 row = texelFetch(display, ivec2(Column, y), 0).rg;
+	uint word = x < 32 ? row.g : row.r;
+	bool lit = ((word >> uint(31 - (x & 31))) & 1u) != 0u;
+
+	FragColor = vec4(lit ? foreground : background, 1.0);
 }
\ No newline at end of file
@@ -1,11 +1,14 @@
 #version 330 core
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec2 aTexCoord;
+layout (location = 2) in vec4 aTile;	// per instance: centre and half size in clip space
 
 out vec2 TexCoord;
+flat out int Column;
 
 void main()
 {
-	gl_Position = vec4(aPos, 1.0);
+	gl_Position = vec4(aTile.xy + aPos.xy * aTile.zw, aPos.z, 1.0);
 	TexCoord = aTexCoord;
+	Column = gl_InstanceID;
 }
\ No newline at end of file
@@ -0,0 +1,264 @@
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <chip8.h>
+
+// chestnut_aot: statically recompiles a ROM into a C++ translation unit.
+//
+// Control flow is walked from START_ADDRESS; every reachable basic block
+// becomes one function and the unit's run function dispatches between them
+// on the PC. The output is compiled together with aot.h, see
+// chestnut_add_aot_executable in CMakeLists.txt.
+
+const unsigned int AOT_MAX_BLOCK = 64;
+
+struct BlockInfo {
+	std::vector<uint16_t> opcodes;
+	bool terminated = false;
+};
+
+struct Uses {
+	bool V = false;
+	bool I = false;
+	bool pc = false;
+	bool stack = false;
+};
+
+#define CHIP8_ID_NAME(name) "chip8::ID_" #name,
+static const char* const id_names[chip8::ID_COUNT] = { "chip8::ID_NULL", CHIP8_INSTRUCTIONS(CHIP8_ID_NAME) };
+#undef CHIP8_ID_NAME
+
+static std::string hex(unsigned value, int width)
+{
+	char buffer[16];
+	std::snprintf(buffer, sizeof(buffer), "0x%0*X", width, value);
+	return buffer;
+}
+
+static bool ends_block(uint8_t id)
+{
+	switch (id) {
+	case chip8::ID_00EE: case chip8::ID_1nnn: case chip8::ID_2nnn: case chip8::ID_3xkk:
+	case chip8::ID_4xkk: case chip8::ID_5xy0: case chip8::ID_9xy0: case chip8::ID_Bnnn:
+	case chip8::ID_Ex9E: case chip8::ID_ExA1: case chip8::ID_Fx0A: case chip8::ID_Fx33:
+	case chip8::ID_Fx55:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static std::map<uint16_t, BlockInfo> walk(const std::vector<uint8_t>& rom)
+{
+	std::map<uint16_t, BlockInfo> blocks;
+	std::vector<uint16_t> pending{ static_cast<uint16_t>(START_ADDRESS) };
+	size_t end = START_ADDRESS + rom.size();
+
+	auto in_rom = [&](unsigned address) { return address >= START_ADDRESS && address + 1 < end; };
+
+	while (!pending.empty()) {
+		uint16_t start = pending.back();
+		pending.pop_back();
+
+		if (!in_rom(start) || blocks.count(start))
+			continue;
+
+		BlockInfo& block = blocks[start];
+		unsigned address = start;
+
+		while (in_rom(address) && block.opcodes.size() < AOT_MAX_BLOCK) {
+			uint16_t opcode = (rom[address - START_ADDRESS] << 8) | rom[address + 1 - START_ADDRESS];
+			uint8_t id = chip8::decode(opcode);
+			block.opcodes.push_back(opcode);
+
+			if (ends_block(id)) {
+				block.terminated = true;
+
+				switch (id) {
+				case chip8::ID_1nnn:
+					pending.push_back(opcode & 0x0FFFu);
+					break;
+				case chip8::ID_2nnn:
+					pending.push_back(opcode & 0x0FFFu);
+					pending.push_back(static_cast<uint16_t>(address + 2));
+					break;
+				case chip8::ID_3xkk: case chip8::ID_4xkk: case chip8::ID_5xy0:
+				case chip8::ID_9xy0: case chip8::ID_Ex9E: case chip8::ID_ExA1:
+					pending.push_back(static_cast<uint16_t>(address + 2));
+					pending.push_back(static_cast<uint16_t>(address + 4));
+					break;
+				case chip8::ID_Fx0A: case chip8::ID_Fx33: case chip8::ID_Fx55:
+					pending.push_back(static_cast<uint16_t>(address + 2));
+					break;
+				default:
+					// 00EE returns to a site queued by its 2nnn, Bnnn is only known at run time
+					break;
+				}
+				break;
+			}
+			address += 2;
+		}
+
+		if (!block.terminated)
+			pending.push_back(static_cast<uint16_t>(start + 2 * block.opcodes.size()));
+	}
+	return blocks;
+}
+
+static std::string translate(uint16_t address, uint16_t opcode, Uses& uses)
+{
+	std::string x = hex((opcode & 0x0F00u) >> 8, 1);
+	std::string y = hex((opcode & 0x00F0u) >> 4, 1);
+	std::string kk = hex(opcode & 0x00FFu, 2);
+	std::string nnn = hex(opcode & 0x0FFFu, 3);
+	std::string next = hex(address + 2, 3);
+	std::string skip = hex(address + 4, 3);
+	std::string Vx = "V[" + x + "]";
+	std::string Vy = "V[" + y + "]";
+
+	uint8_t id = chip8::decode(opcode);
+	switch (id) {
+	case chip8::ID_NULL:
+		return "";
+	case chip8::ID_6xkk: uses.V = true; return Vx + " = " + kk + ";";
+	case chip8::ID_7xkk: uses.V = true; return Vx + " += " + kk + ";";
+	case chip8::ID_8xy0: uses.V = true; return Vx + " = " + Vy + ";";
+	case chip8::ID_8xy1: uses.V = true; return Vx + " |= " + Vy + ";";
+	case chip8::ID_8xy2: uses.V = true; return Vx + " &= " + Vy + ";";
+	case chip8::ID_8xy3: uses.V = true; return Vx + " ^= " + Vy + ";";
+	case chip8::ID_8xy4:
+		uses.V = true;
+		return "{ unsigned sum = " + Vx + " + " + Vy + "; V[0xF] = sum > 255u; " + Vx + " = sum & 0xFFu; }";
+	case chip8::ID_8xy5: uses.V = true; return "V[0xF] = " + Vx + " > " + Vy + "; " + Vx + " -= " + Vy + ";";
+	case chip8::ID_8xy6: uses.V = true; return "V[0xF] = " + Vx + " & 1u; " + Vx + " >>= 1;";
+	case chip8::ID_8xy7: uses.V = true; return "V[0xF] = " + Vy + " > " + Vx + "; " + Vx + " = " + Vy + " - " + Vx + ";";
+	case chip8::ID_8xyE: uses.V = true; return "V[0xF] = (" + Vx + " & 0x80u) >> 7; " + Vx + " <<= 1;";
+	case chip8::ID_Annn: uses.I = true; return "I = " + nnn + ";";
+	case chip8::ID_Fx1E: uses.V = uses.I = true; return "I += " + Vx + ";";
+	case chip8::ID_Fx29: uses.V = uses.I = true; return "I = FONTSET_START_ADDRESS + 5 * " + Vx + ";";
+	case chip8::ID_Fx07: uses.V = true; return Vx + " = chip8_aot::delay_timer(c);";
+	case chip8::ID_Fx15: uses.V = true; return "chip8_aot::delay_timer(c) = " + Vx + ";";
+	case chip8::ID_Fx18: uses.V = true; return "chip8_aot::sound_timer(c) = " + Vx + ";";
+	case chip8::ID_1nnn: uses.pc = true; return "pc = " + nnn + ";";
+	case chip8::ID_2nnn:
+		uses.pc = uses.stack = true;
+		return "stack[sp] = " + next + "; sp = (sp + 1) & 0xFu; pc = " + nnn + ";";
+	case chip8::ID_00EE:
+		uses.pc = uses.stack = true;
+		return "sp = (sp - 1) & 0xFu; pc = stack[sp];";
+	case chip8::ID_3xkk: uses.V = uses.pc = true; return "pc = " + Vx + " == " + kk + " ? " + skip + " : " + next + ";";
+	case chip8::ID_4xkk: uses.V = uses.pc = true; return "pc = " + Vx + " != " + kk + " ? " + skip + " : " + next + ";";
+	case chip8::ID_5xy0: uses.V = uses.pc = true; return "pc = " + Vx + " == " + Vy + " ? " + skip + " : " + next + ";";
+	case chip8::ID_9xy0: uses.V = uses.pc = true; return "pc = " + Vx + " != " + Vy + " ? " + skip + " : " + next + ";";
+	case chip8::ID_Bnnn: uses.V = uses.pc = true; return "pc = V[0x0] + " + nnn + ";";
+	default:
+		// Drawing, randomness, keypad and memory transfers use the interpreter's handlers
+		uses.pc = true;
+		return "pc = " + next + "; chip8_aot::call(c, " + hex(opcode, 4) + ");";
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 3) {
+		std::cerr << "Usage: chestnut_aot <ROM> <output.cpp>" << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+
+	std::ifstream file(argv[1], std::ios::binary);
+	if (!file.is_open()) {
+		std::cerr << "Failed to open ROM " << argv[1] << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+	std::vector<uint8_t> rom((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	if (rom.size() > 4096 - START_ADDRESS)
+		rom.resize(4096 - START_ADDRESS);
+
+	std::map<uint16_t, BlockInfo> blocks = walk(rom);
+
+	std::ostringstream out;
+	out << "// Generated by chestnut_aot from " << argv[1] << ", do not edit.\n\n";
+	out << "#include <aot.h>\n\n";
+
+	out << "static const uint8_t rom[] = {";
+	for (size_t i = 0; i < rom.size(); ++i)
+		out << (i % 12 == 0 ? "\n\t" : " ") << hex(rom[i], 2) << ",";
+	out << "\n};\n\n";
+
+	out << "static const chip8_aot::Block blocks[] = {\n";
+	for (const auto& block : blocks)
+		out << "\t{ " << hex(block.first, 3) << ", " << hex(block.first + 2 * block.second.opcodes.size(), 3) << " },\n";
+	out << "};\n\n";
+
+	for (const auto& block : blocks) {
+		uint16_t start = block.first;
+		const BlockInfo& info = block.second;
+		Uses uses;
+		std::ostringstream body;
+
+		for (size_t i = 0; i < info.opcodes.size(); ++i) {
+			uint16_t address = static_cast<uint16_t>(start + 2 * i);
+			std::string code = translate(address, info.opcodes[i], uses);
+			body << "\t// " << hex(address, 3) << ": " << hex(info.opcodes[i], 4) << "\n";
+			if (!code.empty())
+				body << "\t" << code << "\n";
+			body << "\tchip8_aot::tick(c, " << id_names[chip8::decode(info.opcodes[i])] << ");\n";
+		}
+		if (!info.terminated) {
+			uses.pc = true;
+			body << "\tpc = " << hex(start + 2 * info.opcodes.size(), 3) << ";\n";
+		}
+
+		out << "static void block_" << hex(start, 3) << "(chip8& c)\n{\n";
+		if (uses.V)
+			out << "\tuint8_t* V = chip8_aot::registers(c);\n";
+		if (uses.I)
+			out << "\tuint16_t& I = chip8_aot::index(c);\n";
+		if (uses.pc)
+			out << "\tuint16_t& pc = chip8_aot::pc(c);\n";
+		if (uses.stack)
+			out << "\tuint16_t* stack = chip8_aot::stack(c);\n\tuint8_t& sp = chip8_aot::sp(c);\n";
+		out << "\n" << body.str() << "}\n\n";
+	}
+
+	out << "static void run(chip8_aot& aot, uint64_t cycles)\n{\n";
+	out << "\tchip8& c = aot.cpu();\n";
+	out << "\tconst uint16_t& pc = chip8_aot::pc(c);\n\n";
+	out << "\twhile (cycles > 0) {\n";
+	out << "\t\tif (chip8_aot::halted(c)) {\n";
+	out << "\t\t\tcycles = chip8_aot::wait_for_key(c, cycles);\n";
+	out << "\t\t\tcontinue;\n";
+	out << "\t\t}\n";
+	out << "\t\tswitch (pc) {\n";
+	size_t index = 0;
+	for (const auto& block : blocks) {
+		size_t length = block.second.opcodes.size();
+		out << "\t\tcase " << hex(block.first, 3) << ": if (cycles >= " << length << " && aot.valid(" << index << ")) { block_"
+			<< hex(block.first, 3) << "(c); cycles -= " << length << "; continue; } break;\n";
+		++index;
+	}
+	out << "\t\t}\n";
+	out << "\t\taot.fallback();\n";
+	out << "\t\t--cycles;\n";
+	out << "\t}\n}\n\n";
+
+	out << "int main(int argc, char* argv[])\n{\n";
+	out << "\treturn chip8_aot::main(argc, argv, rom, sizeof(rom), blocks, sizeof(blocks) / sizeof(blocks[0]), &run);\n";
+	out << "}\n";
+
+	std::ofstream output(argv[2]);
+	if (!output.is_open()) {
+		std::cerr << "Failed to write " << argv[2] << std::endl;
+		std::exit(EXIT_FAILURE);
+	}
+	output << out.str();
+
+	std::cout << "chestnut_aot: " << blocks.size() << " blocks from " << rom.size() << " bytes" << std::endl;
+}